@@ -0,0 +1,52 @@
+#include "parser.hpp"
+
+#include <chrono>
+
+using namespace dynaparse;
+
+/**
+ * Loads a generated grammar of n rules (100000 by default) and reports the time
+ * of each step: building it with operator <<, flaten_ebnf and building the Parser.
+ * Every rule uses all EBNF operators:
+ *
+ * 		R_i -> k_i ( R_j | id ) { "," id } [ ";" ( id num ) ]
+ *
+ * and one long rule is a sequence of n / 10 nested sequences:
+ *
+ * 		Long -> ( id num ) ( id num ) ...
+ */
+int main(int argc, const char* argv[]) {
+	typedef std::chrono::steady_clock Clock;
+	auto ms = [](Clock::time_point b) {
+		return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - b).count();
+	};
+	uint n = argc > 1 ? std::stoul(argv[1]) : 100000;
+	Grammar gr("bench");
+	Clock::time_point t = Clock::now();
+	gr << Keywords({",", ";"}) << Regexp("id", "[a-z]+") << Regexp("num", "[0-9]+");
+	for (uint i = 0; i < n; ++ i) gr << new symb::Nonterm("R_" + std::to_string(i)) << Keyword("k" + std::to_string(i));
+	for (uint i = 0; i < n; ++ i) {
+		gr << Rule(R("R_" + std::to_string(i)), Seq({
+			R("k" + std::to_string(i)),
+			Alt({R("R_" + std::to_string((i * 7 + 1) % n)), R("id")}),
+			Iter({R(","), R("id")}),
+			Opt({R(";"), Seq({R("id"), R("num")})})
+		}));
+	}
+	gr << new symb::Nonterm("Long");
+	vector<Syntagma*> pairs;
+	for (uint i = 0; i < n / 10; ++ i) pairs.push_back(Seq({R("id"), R("num")}));
+	gr << Rule(R("Long"), Seq(pairs));
+	std::cout << "build:       " << ms(t) << " ms, " << gr.rules.size() << " rules" << std::endl;
+	t = Clock::now();
+	gr.flaten_ebnf();
+	std::cout << "flaten_ebnf: " << ms(t) << " ms, " << gr.rules.size() << " rules" << std::endl;
+	t = Clock::now();
+	Parser p(gr);
+	std::cout << "parser:      " << ms(t) << " ms" << std::endl;
+	string src = "k0 k1 x, y ; a 1";
+	Expr* ex = p.parse(src, "R_0");
+	std::cout << "parse:       " << (ex ? "OK" : "FAIL") << std::endl;
+	if (ex) delete ex;
+	return ex ? 0 : 1;
+}
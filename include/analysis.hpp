@@ -0,0 +1,170 @@
+#pragma once
+
+#include "syntagma.hpp"
+
+namespace dynaparse {
+
+/**
+ * Nullable, FIRST and FOLLOW sets of a flattened grammar, indexed by symbol ids.
+ * The sets are of characters: a keyword starts with its first character,
+ * a regexp with any character its DFA may start with. Position END in
+ * a FOLLOW set stands for the end of input, every non-terminal may be
+ * the start one, so END follows each of them.
+ */
+struct Analysis {
+	enum { END = 256 };
+	typedef std::bitset<257> Chars;
+
+	Analysis(const Grammar& gr) : nullable(), first(), follow(), users(), defs() {
+		add(gr, 0);
+	}
+
+	/**
+	 * Takes the rules of the grammar from the index from on, which were added
+	 * since the sets were computed (and the new symbols). Adding only grows
+	 * the sets, so a rule is looked at again only when a symbol it depends on
+	 * grew. Returns the symbols, whose sets changed. After a rule is removed,
+	 * the analysis is made anew.
+	 */
+	vector<uint> add(const Grammar& gr, size_t from) {
+		vector<uint> ret;
+		for (uint i = nullable.size(); i < gr.symb_ids.size(); ++ i) ret.push_back(i);
+		nullable.resize(gr.symb_ids.size(), false);
+		first.resize(gr.symb_ids.size());
+		follow.resize(gr.symb_ids.size());
+		users.resize(gr.symb_ids.size());
+		defs.resize(gr.symb_ids.size());
+		for (const Symb* s : gr.symbs) {
+			if (s->id >= nullable.size() - ret.size()) init(s);
+		}
+		vector<const Rule*> work(gr.rules.begin() + from, gr.rules.end());
+		for (const Rule* r : work) {
+			defs[r->left->ref->id].push_back(r);
+			for (const Symb* s : rhs(r)) users[s->id].push_back(r);
+		}
+		vector<bool> grown(nullable.size(), false);
+		for (uint i : ret) grown[i] = true;
+		// nullable and FIRST: a rule depends on the symbols of its right side
+		for (vector<const Rule*> queue = work; !queue.empty(); ) {
+			const Rule* r = queue.back();
+			queue.pop_back();
+			uint a = r->left->ref->id;
+			Chars f = first[a] | first_of(rhs(r));
+			bool n = nullable[a] || nullable_of(rhs(r));
+			if (f == first[a] && n == nullable[a]) continue;
+			first[a] = f;
+			nullable[a] = n;
+			grown[a] = true;
+			queue.insert(queue.end(), users[a].begin(), users[a].end());
+		}
+		// FOLLOW: a rule depends on its left side and on FIRST of its right side
+		for (uint i = 0; from && i < grown.size(); ++ i) {
+			if (grown[i]) work.insert(work.end(), users[i].begin(), users[i].end());
+		}
+		while (!work.empty()) {
+			const Rule* r = work.back();
+			work.pop_back();
+			vector<const Symb*> right = rhs(r);
+			Chars tail = follow[r->left->ref->id];
+			for (auto it = right.rbegin(); it != right.rend(); ++ it) {
+				uint x = (*it)->id;
+				if ((*it)->kind == Symb::NONTERM && (follow[x] | tail) != follow[x]) {
+					follow[x] |= tail;
+					grown[x] = true;
+					work.insert(work.end(), defs[x].begin(), defs[x].end());
+				}
+				tail = nullable[x] ? tail | first[x] : first[x];
+			}
+		}
+		ret.clear();
+		for (uint i = 0; i < grown.size(); ++ i) if (grown[i]) ret.push_back(i);
+		return ret;
+	}
+
+	/// Symbols of the right side of a flattened rule.
+	static vector<const Symb*> rhs(const Rule* r) {
+		vector<const Symb*> ret;
+		if (r->right->kind == Syntagma::REF) {
+			ret.push_back(static_cast<const rule::Ref*>(r->right)->ref);
+		} else if (r->right->kind == Syntagma::SEQ) {
+			for (const Syntagma* s : static_cast<const rule::Seq*>(r->right)->operands) {
+				if (s->kind != Syntagma::REF) {
+					std::cerr << "grammar must be flattened before the analysis" << std::endl;
+					throw std::exception();
+				}
+				ret.push_back(static_cast<const rule::Ref*>(s)->ref);
+			}
+		}
+		return ret;
+	}
+	Chars first_of(const vector<const Symb*>& seq) const {
+		Chars ret;
+		for (const Symb* s : seq) {
+			ret |= first[s->id];
+			if (!nullable[s->id]) break;
+		}
+		return ret;
+	}
+	bool nullable_of(const vector<const Symb*>& seq) const {
+		for (const Symb* s : seq) if (!nullable[s->id]) return false;
+		return true;
+	}
+
+	string show(const Grammar& gr) const {
+		string ret;
+		vector<bool> shown(nullable.size(), false);
+		for (const Symb* s : gr.symbs) {
+			if (s->kind != Symb::NONTERM || shown[s->id]) continue;
+			shown[s->id] = true;
+			ret += s->name + (nullable[s->id] ? " nullable" : "");
+			ret += " first: " + show(first[s->id]) + " follow: " + show(follow[s->id]) + "\n";
+		}
+		return ret;
+	}
+	static string show(const Chars& cs) {
+		string ret = "{";
+		for (int c = 0; c < 257; ++ c) {
+			if (!cs[c]) continue;
+			if (ret.size() > 1) ret += " ";
+			ret += c == END ? string("$") : (c > ' ' && c < 127 ? string(1, c) : "\\" + std::to_string(c));
+		}
+		return ret + "}";
+	}
+
+	vector<bool>  nullable;
+	vector<Chars> first;
+	vector<Chars> follow;
+	vector<vector<const Rule*>> users; // the rules with the symbol on the right side
+	vector<vector<const Rule*>> defs;  // the rules of the non-terminal
+
+private:
+	/// The sets of a new symbol, before any rule is taken.
+	void init(const Symb* s) {
+		switch (s->kind) {
+		case Symb::KEYWORD: {
+			const string& body = s->key();
+			if (body.empty()) nullable[s->id] = true;
+			else first[s->id].set(static_cast<unsigned char>(body[0]));
+			break;
+		}
+		case Symb::REGEXP: {
+			const Dfa& dfa = static_cast<const symb::Regexp*>(s)->dfa;
+			if (dfa.valid()) {
+				Dfa::Chars f = dfa.first();
+				for (int c = 0; c < 256; ++ c) if (f[c]) first[s->id].set(c);
+				nullable[s->id] = dfa.nullable();
+			} else {
+				first[s->id].set();
+				first[s->id].reset(END);
+				nullable[s->id] = true;
+			}
+			break;
+		}
+		case Symb::NONTERM:
+			follow[s->id].set(END);
+			break;
+		}
+	}
+};
+
+}
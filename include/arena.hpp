@@ -0,0 +1,74 @@
+#pragma once
+
+#include "std.hpp"
+
+namespace dynaparse {
+
+/**
+ * Bump allocator for parse trees. Objects allocated in an arena are never
+ * destroyed one by one: the parser rolls the arena back to a mark when it
+ * backtracks, and the whole tree is freed with clear() (the memory is kept
+ * for the next parse) or with the arena itself.
+ */
+class ExprArena {
+public:
+	struct Mark {
+		size_t block;
+		size_t used;
+	};
+
+	ExprArena(size_t bs = 1 << 16) : block_size(bs), blocks(), cur(0), used(0) { }
+	ExprArena(const ExprArena&) = delete;
+	ExprArena& operator = (const ExprArena&) = delete;
+	~ ExprArena() {
+		for (Block& b : blocks) ::operator delete(b.data);
+	}
+
+	void* alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+		while (true) {
+			if (cur < blocks.size()) {
+				size_t p = (used + align - 1) & ~(align - 1);
+				if (p + size <= blocks[cur].size) {
+					used = p + size;
+					return blocks[cur].data + p;
+				}
+				if (cur + 1 < blocks.size() && blocks[cur + 1].size >= size) {
+					++ cur;
+					used = 0;
+					continue;
+				}
+			}
+			size_t s = std::max(block_size, size);
+			size_t at = blocks.empty() ? 0 : cur + 1;
+			blocks.insert(blocks.begin() + at, Block{static_cast<char*>(::operator new(s)), s});
+			cur = at;
+			used = 0;
+		}
+	}
+
+	Mark mark() const { return Mark{cur, used}; }
+	void rollback(Mark m) {
+		cur = m.block;
+		used = m.used;
+	}
+	void clear() { rollback(Mark{0, 0}); }
+
+	/// Number of bytes in the blocks, which are in use.
+	size_t size() const {
+		size_t ret = used;
+		for (size_t i = 0; i < cur && i < blocks.size(); ++ i) ret += blocks[i].size;
+		return ret;
+	}
+
+private:
+	struct Block {
+		char*  data;
+		size_t size;
+	};
+	size_t        block_size;
+	vector<Block> blocks;
+	size_t        cur;
+	size_t        used;
+};
+
+}
@@ -0,0 +1,196 @@
+#pragma once
+
+#include "symb.hpp"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DYNAPARSE_X86 1
+#endif
+
+namespace dynaparse {
+
+typedef bool (Skipper) (char);
+
+/// A comment the parsers skip: from open to close. A line comment closes with "\n".
+struct Comment {
+	string open;
+	string close;
+};
+
+/**
+ * What is skipped between lexemes: runs of a character class and comments.
+ * The class is taken from a Skipper (a predicate, sampled once for all 256
+ * chars) or a bit set. Two kinds of classes are scanned 16 or 32 bytes at a
+ * time, with SSE2 or AVX2 as the processor supports: an interval of signed
+ * chars (the default skipper c <= ' ' is [-128, 32]) and a set of up to
+ * 8 chars (like " \t\r\n"). Other classes are tested char by char.
+ * An unterminated comment is not skipped, except a line comment at the end
+ * of the source.
+ */
+class Blanks {
+public:
+	enum Kind : uint8_t { INTERVAL, CHARS, TABLE };
+	enum { MAX_CHARS = 8 };
+
+	Blanks(Skipper* s, const vector<Comment>& cs = {}) : set{0, 0, 0, 0}, kind(TABLE), lo(0), hi(0), chars(), comments(cs), opens{0, 0, 0, 0} {
+		for (uint c = 0; c < 256; ++ c) if (s(char(c))) set[c >> 6] |= uint64_t(1) << (c & 63);
+		init();
+	}
+	Blanks(const uint64_t* s, const vector<Comment>& cs = {}) : set{s[0], s[1], s[2], s[3]}, kind(TABLE), lo(0), hi(0), chars(), comments(cs), opens{0, 0, 0, 0} {
+		init();
+	}
+
+	bool skips(char c) const { unsigned char u = c; return set[u >> 6] >> (u & 63) & 1; }
+	/// A skipped run may begin with c: it is in the class or opens a comment.
+	bool starts(char c) const { unsigned char u = c; return (set[u >> 6] | opens[u >> 6]) >> (u & 63) & 1; }
+
+	void skip(StrIter& p, StrIter end) const {
+		while (p != end) {
+			if (skips(*p)) p = run(p, end);
+			if (p == end || !comment(p, end)) return;
+		}
+	}
+
+	/**
+	 * Skipping, which stopped at p, could go on, if the text went on after end:
+	 * p is end or a comment opens at p, which is not closed before end.
+	 */
+	bool cut(StrIter p, StrIter end) const {
+		if (p == end) return true;
+		for (const Comment& c : comments) {
+			if (!std::memcmp(p, c.open.data(), std::min(c.open.size(), size_t(end - p)))) return true;
+		}
+		return false;
+	}
+
+	const uint64_t* table() const { return set; }
+	const vector<Comment>& delimiters() const { return comments; }
+	/// The vector extension the scans use: "avx2", "sse2" or "none".
+	static const char* simd();
+
+private:
+	typedef StrIter (Scan)(const Blanks&, StrIter, StrIter);
+
+	void init() {
+		for (const Comment& c : comments) {
+			if (c.open.empty()) {
+				std::cerr << "comment without an opening delimiter" << std::endl;
+				throw std::exception();
+			}
+			unsigned char u = c.open[0];
+			opens[u >> 6] |= uint64_t(1) << (u & 63);
+		}
+		int first = 256, last = -1;
+		uint count = 0;
+		for (int c = -128; c < 128; ++ c) {
+			if (!skips(char(c))) continue;
+			if (count < MAX_CHARS) chars[count] = char(c);
+			++ count;
+			first = std::min(first, c);
+			last = c;
+		}
+		if (count && uint(last - first + 1) == count) {
+			kind = INTERVAL;
+			lo = char(first);
+			hi = char(last);
+		} else if (count && count <= MAX_CHARS) {
+			kind = CHARS;
+			for (uint i = count; i < MAX_CHARS; ++ i) chars[i] = chars[0];
+		}
+	}
+
+	/// The end of the run of the class, which begins at p.
+	StrIter run(StrIter p, StrIter end) const {
+		static Scan* const scan = select();
+		if (kind != TABLE) p = scan(*this, p, end);
+		while (p != end && skips(*p)) ++p;
+		return p;
+	}
+
+	/// Skips a comment at p, if one opens there.
+	bool comment(StrIter& p, StrIter end) const {
+		for (const Comment& c : comments) {
+			size_t n = c.open.size();
+			if (size_t(end - p) < n || std::memcmp(p, c.open.data(), n)) continue;
+			StrIter b = p + n;
+			StrIter e = c.close.empty() ? b : std::search(b, end, c.close.begin(), c.close.end());
+			if (e != end) {
+				p = e + c.close.size();
+				return true;
+			}
+			if (c.close != "\n") return false;
+			p = end;
+			return true;
+		}
+		return false;
+	}
+
+	static Scan* select();
+	static StrIter scan_sse2(const Blanks& b, StrIter p, StrIter end);
+	static StrIter scan_avx2(const Blanks& b, StrIter p, StrIter end);
+
+	uint64_t        set[4];
+	Kind            kind;
+	char            lo;     // INTERVAL: the bounds, as signed chars
+	char            hi;
+	char            chars[MAX_CHARS]; // CHARS: the class, the first one repeated
+	vector<Comment> comments;
+	uint64_t        opens[4]; // first chars of the comments
+};
+
+#ifdef DYNAPARSE_X86
+
+/// The scans return the first position of a block, which has a char out of the class, the rest is scalar.
+inline StrIter Blanks::scan_sse2(const Blanks& b, StrIter p, StrIter end) {
+	const __m128i lo = _mm_set1_epi8(b.lo), hi = _mm_set1_epi8(b.hi);
+	for (; end - p >= 16; p += 16) {
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+		__m128i in;
+		if (b.kind == INTERVAL) {
+			in = _mm_andnot_si128(_mm_or_si128(_mm_cmplt_epi8(x, lo), _mm_cmpgt_epi8(x, hi)), _mm_set1_epi8(-1));
+		} else {
+			in = _mm_setzero_si128();
+			for (uint i = 0; i < MAX_CHARS; ++ i) in = _mm_or_si128(in, _mm_cmpeq_epi8(x, _mm_set1_epi8(b.chars[i])));
+		}
+		uint mask = ~uint(_mm_movemask_epi8(in)) & 0xffff;
+		if (mask) return p + __builtin_ctz(mask);
+	}
+	return p;
+}
+
+__attribute__((target("avx2")))
+inline StrIter Blanks::scan_avx2(const Blanks& b, StrIter p, StrIter end) {
+	const __m256i lo = _mm256_set1_epi8(b.lo), hi = _mm256_set1_epi8(b.hi);
+	for (; end - p >= 32; p += 32) {
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+		__m256i in;
+		if (b.kind == INTERVAL) {
+			__m256i out = _mm256_or_si256(_mm256_cmpgt_epi8(lo, x), _mm256_cmpgt_epi8(x, hi));
+			in = _mm256_xor_si256(out, _mm256_set1_epi8(-1));
+		} else {
+			in = _mm256_setzero_si256();
+			for (uint i = 0; i < MAX_CHARS; ++ i) in = _mm256_or_si256(in, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(b.chars[i])));
+		}
+		uint mask = ~uint(_mm256_movemask_epi8(in));
+		if (mask) return p + __builtin_ctz(mask);
+	}
+	return scan_sse2(b, p, end);
+}
+
+inline Blanks::Scan* Blanks::select() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? &scan_avx2 : &scan_sse2;
+}
+
+inline const char* Blanks::simd() { return select() == &scan_avx2 ? "avx2" : "sse2"; }
+
+#else
+
+inline StrIter Blanks::scan_sse2(const Blanks&, StrIter p, StrIter) { return p; }
+inline StrIter Blanks::scan_avx2(const Blanks&, StrIter p, StrIter) { return p; }
+inline Blanks::Scan* Blanks::select() { return &scan_sse2; }
+inline const char* Blanks::simd() { return "none"; }
+
+#endif
+
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include "parser.hpp"
+
+#include <fstream>
+
+namespace dynaparse {
+
+/**
+ * A parse tree cached in a file, so that a later run skips parsing a source,
+ * which did not change. The file holds the nodes of a FlatTree (rule ids,
+ * offsets into the source and the child structure) after a header with the
+ * key of the parse: the fingerprint of the grammar (see Grammar::fingerprint,
+ * any change through Grammar::add gives another one), a hash and the length
+ * of the source and a hash of the start symbol. A failed parse is cached as
+ * an empty tree. Loading maps the file, the nodes are read in place. As with
+ * Image, the file follows the byte order and type sizes of the machine.
+ */
+class TreeCache {
+public:
+	enum { FORMAT = 1, ORDER = 0x01020304 };
+
+	struct Key {
+		uint64_t grammar;
+		uint64_t source;
+		uint64_t length;
+		uint64_t start;
+		bool operator == (const Key& k) const {
+			return grammar == k.grammar && source == k.source && length == k.length && start == k.start;
+		}
+	};
+	struct Header {
+		char     magic[8];
+		uint32_t format;
+		uint32_t order;
+		uint32_t node_size;
+		uint32_t reserved;
+		Key      key;
+		uint64_t count; // of the nodes
+	};
+
+	/// A hash of the text, read 8 bytes at a time.
+	static uint64_t hash(StrIter b, StrIter e) {
+		uint64_t h = 0x9e3779b97f4a7c15ull ^ uint64_t(e - b);
+		auto mix = [&h](uint64_t w) {
+			h = (h ^ w) * 0xff51afd7ed558ccdull;
+			h ^= h >> 32;
+		};
+		for (; e - b >= 8; b += 8) {
+			uint64_t w;
+			std::memcpy(&w, b, 8);
+			mix(w);
+		}
+		uint64_t w = 0;
+		if (b != e) std::memcpy(&w, b, e - b);
+		mix(w);
+		return h;
+	}
+	static Key key(const Grammar& gr, Source src, const string& type) {
+		return Key{gr.fingerprint(), hash(src.beg, src.end), uint64_t(src.end - src.beg), hash(type.data(), type.data() + type.size())};
+	}
+
+	static void write(const FlatTree& tree, const Key& key, ostream& os);
+
+	TreeCache(const string& path);
+	TreeCache(const TreeCache&) = delete;
+	TreeCache& operator = (const TreeCache&) = delete;
+
+	const Key& key() const { return header->key; }
+	bool empty() const { return !header->count; }
+	uint size() const { return header->count; }
+	const FlatTree::Node& root() const { return nodes[0]; }
+	const FlatTree::Node& operator[] (uint i) const { return nodes[i]; }
+	const FlatTree::Node* begin(const FlatTree::Node& n) const { return nodes + n.first; }
+	const FlatTree::Node* end(const FlatTree::Node& n) const { return nodes + n.first + n.size; }
+	/// Copies the nodes into a tree, which outlives the mapping.
+	void assign(FlatTree& out) const { out.nodes.assign(nodes, nodes + size()); }
+
+private:
+	MappedFile             file;
+	const Header*          header;
+	const FlatTree::Node*  nodes;
+};
+
+void TreeCache::write(const FlatTree& tree, const Key& key, ostream& os) {
+	Header h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, "DPTREE\0\0", 8);
+	h.format = FORMAT;
+	h.order = ORDER;
+	h.node_size = sizeof(FlatTree::Node);
+	h.key = key;
+	h.count = tree.size();
+	os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	os.write(reinterpret_cast<const char*>(tree.nodes.data()), tree.size() * sizeof(FlatTree::Node));
+}
+
+TreeCache::TreeCache(const string& path) : file(path), header(reinterpret_cast<const Header*>(file.data())), nodes(nullptr) {
+	bool ok = file.size() >= sizeof(Header) && !std::memcmp(header->magic, "DPTREE\0\0", 8) && header->format == FORMAT &&
+		header->order == ORDER && header->node_size == sizeof(FlatTree::Node) &&
+		header->count == (file.size() - sizeof(Header)) / sizeof(FlatTree::Node) &&
+		(file.size() - sizeof(Header)) % sizeof(FlatTree::Node) == 0;
+	if (!ok) {
+		std::cerr << "file " << path << " is not a cached tree of this version" << std::endl;
+		throw std::exception();
+	}
+	nodes = reinterpret_cast<const FlatTree::Node*>(header + 1);
+}
+
+/**
+ * Parses a source into out, unless path holds the tree of the same parse:
+ * then it is loaded instead. Otherwise the tree is cached in path; the file
+ * is replaced at once (by rename), so that processes, which share the cache,
+ * never read a part of it.
+ */
+inline bool parse_cached(const Parser& p, Source src, const string& type, const string& path, FlatTree& out, bool packrat = false) {
+	TreeCache::Key key = TreeCache::key(p.grammar, src, type);
+	if (!::access(path.c_str(), R_OK)) {
+		try {
+			TreeCache cache(path);
+			if (cache.key() == key) {
+				cache.assign(out);
+				return !out.empty();
+			}
+		} catch (std::exception&) { } // rewritten below
+	}
+	p.parse(src, type, out, packrat);
+	string tmp = path + "." + std::to_string(::getpid()) + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+	{
+		std::ofstream os(tmp, std::ios::binary);
+		TreeCache::write(out, key, os);
+	}
+	if (::rename(tmp.c_str(), path.c_str())) {
+		::unlink(tmp.c_str());
+		std::cerr << "can't write file " << path << std::endl;
+		throw std::exception();
+	}
+	return !out.empty();
+}
+
+}
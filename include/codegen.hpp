@@ -0,0 +1,241 @@
+#pragma once
+
+#include "parser.hpp"
+
+#include <iomanip>
+#include <sstream>
+
+namespace dynaparse {
+namespace gen {
+
+/**
+ * Runtime of generated parsers (see generate): the grammar they were
+ * generated from, the children stack and the helpers the generated code
+ * calls. A generated parser keeps state while parsing, so a thread needs
+ * its own one; it needs the grammar for the rules of the nodes, regexps
+ * and the skipper.
+ */
+class Runtime {
+public:
+	Runtime(const Grammar& gr, uint64_t fingerprint, const char* cls) :
+		grammar(gr), blanks(gr.skipper, gr.comments), symbs(gr.symb_ids.size(), nullptr), last(nullptr), arena(nullptr), start_mark{0, 0}, kids() {
+		if (gr.fingerprint() != fingerprint) {
+			std::cerr << "grammar " << gr.name << " is not the one " << cls << " was generated from" << std::endl;
+			throw std::exception();
+		}
+		for (const Symb* s : gr.symbs) {
+			if (!symbs[s->id]) symbs[s->id] = s;
+			if (s->kind == Symb::REGEXP) static_cast<const symb::Regexp*>(s)->dfa.complete();
+		}
+	}
+
+	const Grammar& grammar;
+	const Blanks   blanks;
+
+protected:
+	StrIter start(Source src, ExprArena* a) {
+		last = src.end;
+		arena = a;
+		start_mark = mark();
+		kids.clear();
+		return src.beg;
+	}
+	/// The whole source must be parsed, as with Parser::parse.
+	Expr* finish(Expr* ex, StrIter pos) {
+		if (ex) {
+			skip(pos);
+			if (pos == last) return ex;
+			if (!arena) release(ex);
+		}
+		if (arena) arena->rollback(start_mark);
+		return nullptr;
+	}
+	[[noreturn]] static void undefined(const string& type) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
+	}
+
+	void skip(StrIter& p) const { blanks.skip(p, last); }
+	bool first(StrIter p, const uint64_t* set) const {
+		uint c = p == last ? uint(Analysis::END) : static_cast<unsigned char>(*p);
+		return set[c >> 6] >> (c & 63) & 1;
+	}
+	ExprArena::Mark mark() const { return arena ? arena->mark() : ExprArena::Mark{0, 0}; }
+
+	/// A terminal of len characters is matched at p.
+	bool lexeme(StrIter& p, size_t len) {
+		kids.push_back(create<expr::Lexeme>(arena, p, p + len));
+		p += len;
+		return true;
+	}
+	bool regexp(StrIter& p, uint id) {
+		StrIter b = p;
+		if (!static_cast<const symb::Regexp*>(symbs[id])->matches(p, last)) return false;
+		kids.push_back(create<expr::Lexeme>(arena, b, p));
+		return true;
+	}
+	bool push(Expr* ex) {
+		if (ex) kids.push_back(ex);
+		return ex;
+	}
+	/// Drops the last child, when the rest of a level after it failed.
+	void drop(ExprArena::Mark m) {
+		if (!arena) release(kids.back());
+		else arena->rollback(m);
+		kids.pop_back();
+	}
+	Expr* accept(StrIter b, StrIter e, uint rule, size_t base, StrIter& pos) {
+		ExprSpan children(kids.data() + base, kids.size() - base);
+		Expr* ex = create<expr::Seq>(arena, b, e, grammar.rules[rule], children, arena);
+		kids.resize(base);
+		pos = e;
+		return ex;
+	}
+
+	vector<const Symb*> symbs; // by id
+	StrIter             last;
+	ExprArena*          arena;
+	ExprArena::Mark     start_mark;
+	vector<Expr*>       kids;
+};
+
+/// Writes the functions of the non-terminals, collects the lookahead sets they test.
+struct Writer {
+	ostream&       os;
+	unordered_map<Analysis::Chars, uint> sets;
+	vector<Analysis::Chars> set_list;
+
+	string indent(uint d) const { return string(2 * d + 2, '\t'); }
+
+	string set(const Analysis::Chars& s) {
+		auto it = sets.emplace(s, set_list.size()).first;
+		if (it->second == set_list.size()) set_list.push_back(s);
+		return std::to_string(it->second);
+	}
+
+	static string literal(const string& s) {
+		std::ostringstream ret;
+		ret << '"';
+		for (unsigned char c : s) {
+			if (c == '"' || c == '\\') ret << '\\' << c;
+			else if (c < ' ' || c > '~') ret << '\\' << std::oct << std::setw(3) << std::setfill('0') << uint(c) << std::dec;
+			else ret << c;
+		}
+		ret << '"';
+		return ret.str();
+	}
+
+	/// The condition, which matches node n at p and pushes its child.
+	string match(const parser::Node& n, const string& p) {
+		switch (n.kind) {
+		case Symb::KEYWORD: {
+			const string& kw = n.symb->key();
+			string len = std::to_string(kw.size());
+			if (kw.empty()) return "lexeme(" + p + ", 0)";
+			return "last - " + p + " >= " + len + " && !std::memcmp(" + p + ", " + literal(kw) + ", " + len + ") && lexeme(" + p + ", " + len + ")";
+		}
+		case Symb::REGEXP:
+			return "regexp(" + p + ", " + std::to_string(n.id) + ")";
+		default:
+			return "push(nt_" + std::to_string(n.id) + "(" + p + "))";
+		}
+	}
+
+	/// The nodes of a level at position p<d> (already skipped) are tried in order.
+	void level(const parser::Tree& t, const parser::Tree& root, uint d) {
+		string p = "p" + std::to_string(d), q = "p" + std::to_string(d + 1), m = "m" + std::to_string(d + 1);
+		string in = indent(d);
+		for (const parser::Node& n : t) {
+			if (n.kind == Symb::NONTERM) {
+				bool initial = &n == &root.front() && n.tree->size() &&
+					n.tree->front().kind == Symb::NONTERM && n.tree->front().tree == n.tree;
+				if (initial || !n.tree->size()) continue;
+			}
+			if (!n.rule && n.next.empty()) continue;
+			os << in << "// " << literal(n.symb->name) << "\n";
+			if (n.first.all()) os << in << "{\n";
+			else os << in << "if (first(" << p << ", sets[" << set(n.first) << "])) {\n";
+			os << in << "\tStrIter " << q << " = " << p << ";\n";
+			if (!n.rule) os << in << "\tExprArena::Mark " << m << " = mark();\n";
+			os << in << "\tif (" << match(n, q) << ") {\n";
+			if (n.rule) {
+				os << in << "\t\treturn accept(b, " << q << ", " << n.rule->id << ", base, pos);\n";
+			} else {
+				os << in << "\t\tskip(" << q << ");\n";
+				level(n.next, root, d + 1);
+				os << in << "\t\tdrop(" << m << ");\n";
+			}
+			os << in << "\t}\n";
+			os << in << "}\n";
+		}
+	}
+};
+
+/**
+ * Writes a recursive-descent parser, specialized for a flattened grammar,
+ * as a C++ header: class cls in namespace dynaparse::gen. Each non-terminal
+ * becomes a function, which tries the nodes of its trie in order, keywords
+ * are compared inline. The generated parser builds the same trees as Parser
+ * (without packrat memo) and refuses a grammar with another fingerprint.
+ * Nesting of the input is limited by the native stack.
+ */
+inline void generate(Grammar& gr, const string& cls, ostream& os) {
+	Parser parser(gr);
+	std::ostringstream body;
+	Writer w{body, {}, {}};
+	for (auto& p : parser.trees) {
+		const Symb* nt = gr.symb_map.at(p.first);
+		body << "\t// " << p.first << "\n";
+		body << "\tExpr* nt_" << nt->id << "(StrIter& pos) {\n";
+		if (p.second.size()) {
+			body << "\t\tStrIter b = pos;\n";
+			body << "\t\tskip(b);\n";
+			body << "\t\tsize_t base = kids.size();\n";
+			body << "\t\tStrIter p0 = b;\n";
+			w.level(p.second, p.second, 0);
+		}
+		body << "\t\treturn nullptr;\n";
+		body << "\t}\n";
+	}
+	os << "#pragma once\n\n";
+	os << "// Generated by dynaparse from grammar " << gr.name << ", do not edit.\n\n";
+	os << "#include \"codegen.hpp\"\n\n";
+	os << "namespace dynaparse {\nnamespace gen {\n\n";
+	os << "class " << cls << " : public Runtime {\n";
+	os << "public:\n";
+	os << "\t" << cls << "(const Grammar& gr) : Runtime(gr, 0x" << std::hex << gr.fingerprint() << std::dec << "ull, \"" << cls << "\") { }\n\n";
+	os << "\tExpr* parse(Source src, const string& type, ExprArena* arena = nullptr) {\n";
+	os << "\t\tstatic const map<string, Expr* (" << cls << "::*)(StrIter&)> starts = {\n";
+	for (auto& p : parser.trees) {
+		os << "\t\t\t{" << Writer::literal(p.first) << ", &" << cls << "::nt_" << gr.symb_map.at(p.first)->id << "},\n";
+	}
+	os << "\t\t};\n";
+	os << "\t\tauto it = starts.find(type);\n";
+	os << "\t\tif (it == starts.end()) undefined(type);\n";
+	os << "\t\tStrIter pos = start(src, arena);\n";
+	os << "\t\tExpr* ex = (this->*it->second)(pos);\n";
+	os << "\t\treturn finish(ex, pos);\n";
+	os << "\t}\n\n";
+	os << "private:\n";
+	os << "\tstatic constexpr uint64_t sets[][5] = {\n";
+	for (const Analysis::Chars& s : w.set_list) {
+		os << "\t\t{";
+		for (uint k = 0; k < 5; ++ k) {
+			uint64_t word = 0;
+			for (uint c = 64 * k; c < std::min<uint>(64 * k + 64, Analysis::END + 1); ++ c) {
+				if (s[c]) word |= uint64_t(1) << (c & 63);
+			}
+			os << (k ? ", " : "") << "0x" << std::hex << word << std::dec << "ull";
+		}
+		os << "},\n";
+	}
+	if (w.set_list.empty()) os << "\t\t{0, 0, 0, 0, 0}\n";
+	os << "\t};\n\n";
+	os << body.str();
+	os << "};\n\n";
+	os << "constexpr uint64_t " << cls << "::sets[][5];\n\n";
+	os << "}\n}\n";
+}
+
+} // namespace gen
+}
@@ -0,0 +1,473 @@
+#pragma once
+
+#include "std.hpp"
+
+namespace dynaparse {
+
+/**
+ * Regular expression matcher for lexeme definitions: the pattern is parsed
+ * into a Thompson NFA, which is turned into a DFA lazily, state by state,
+ * while matching. Once the reachable states are built, matching does
+ * no allocation.
+ *
+ * Supported subset of the ECMAScript syntax: literals, escapes (\d \w \s \D \W \S,
+ * \t \n \r \f \v \0 \xHH and escaped punctuation), '.', character classes
+ * with ranges and negation, groups '(...)' and '(?:...)', alternation and
+ * the greedy quantifiers * + ? {n} {n,} {n,m}. Anchors, back references,
+ * lookaheads and lazy quantifiers are not supported: valid() is false then.
+ *
+ * The match is the one std::regex finds: the first alternative and the greedy
+ * choice of a quantifier, which lead to a match, win. A state of the DFA keeps
+ * the NFA threads in the order of their priority and drops the ones after
+ * a match (as RE2 does), so "a|ab" matches one char of "ab".
+ *
+ * Several patterns (regular expressions or literal strings) may be combined
+ * into one automaton: scan() then reports the match of each pattern
+ * in a single pass over the input.
+ *
+ * Lazy building is not thread-safe: an automaton shared by threads has to be
+ * completed (see complete()) before.
+ */
+class Dfa {
+public:
+	typedef std::bitset<256> Chars;
+	enum { MAX_STATES = 4096, MAX_REPEAT = 256 };
+
+	struct Pattern {
+		string text;
+		bool   literal;
+	};
+
+	Dfa(const string& pattern) : Dfa(vector<Pattern>{{pattern, false}}) { }
+	Dfa(const vector<Pattern>& patterns) :
+		nfa(), sets(), start(-1), compiled(patterns.size(), false), trans(), states(), index(), accept(), tags(), frozen(false) {
+		vector<int> starts;
+		for (uint t = 0; t < patterns.size(); ++ t) {
+			Parser p(patterns[t].text, sets);
+			int root = patterns[t].literal ? p.literal() : p.parse();
+			if (root < 0) continue;
+			size_t from = nfa.size();
+			starts.push_back(compile(p, root, add(State::MATCH, t)));
+			for (size_t i = from; i < nfa.size(); ++ i) nfa[i].pattern = t;
+			compiled[t] = true;
+		}
+		if (starts.empty()) return;
+		start = starts.size() == 1 ? starts[0] : add(State::EPS, -1, starts);
+		intern(vector<int>());          // dead state 0
+		intern(closure({start}));       // start state 1
+	}
+
+	bool valid() const { return start >= 0; }
+	bool valid(uint tag) const { return compiled[tag]; }
+	uint size() const { return compiled.size(); }
+
+	/**
+	 * Length of the match at ch, -1 if there is no match,
+	 * -2 if the automaton grew too big (the caller has to use another matcher).
+	 */
+	template<class Iter>
+	int match(Iter ch, Iter end) const {
+		int s = 1;
+		int len = accept[1] ? 0 : -1;
+		for (Iter p = ch; p != end; ++ p) {
+			unsigned char c = *p;
+			int n = trans[s * 256 + c];
+			if (n < 0 && (n = step(s, c)) < 0) return -2;
+			if (!n) break;
+			s = n;
+			if (accept[s]) len = p - ch + 1;
+		}
+		return len;
+	}
+
+	/**
+	 * Number of chars, which a match at ch reads: up to the one leading to
+	 * the dead state, or one more than there are, if it reads up to the end
+	 * (or the automaton grew too big).
+	 */
+	template<class Iter>
+	size_t extent(Iter ch, Iter end) const {
+		int s = 1;
+		for (Iter p = ch; p != end; ++ p) {
+			unsigned char c = *p;
+			int n = trans[s * 256 + c];
+			if (n < 0 && (n = step(s, c)) < 0) break;
+			if (!n) return p - ch + 1;
+			s = n;
+		}
+		return end - ch + 1;
+	}
+
+	/**
+	 * Match length of every pattern at ch, -1 for no match.
+	 * Returns false if the automaton grew too big, lens are not valid then.
+	 */
+	template<class Iter>
+	bool scan(Iter ch, Iter end, int* lens) const {
+		std::fill(lens, lens + compiled.size(), -1);
+		int s = 1;
+		for (uint t : tags[1]) lens[t] = 0;
+		for (Iter p = ch; p != end; ++ p) {
+			unsigned char c = *p;
+			int n = trans[s * 256 + c];
+			if (n < 0 && (n = step(s, c)) < 0) return false;
+			if (!n) break;
+			s = n;
+			for (uint t : tags[s]) lens[t] = p - ch + 1;
+		}
+		return true;
+	}
+
+	/// Characters which may start a non-empty match.
+	Chars first() const {
+		Chars ret;
+		for (int i : states[1]) if (nfa[i].kind == State::SET) ret |= sets[nfa[i].set];
+		return ret;
+	}
+	/// Whether the empty string matches.
+	bool nullable() const { return accept[1]; }
+
+	/**
+	 * Builds all the reachable states at once and freezes the automaton: it is
+	 * never changed afterwards, so matching becomes read-only. Returns false when
+	 * the automaton does not fit into MAX_STATES, then the missing transitions
+	 * report an overflow, as the lazy building does.
+	 */
+	bool complete() const {
+		if (!frozen && valid()) {
+			for (uint s = 1; s < states.size(); ++ s) {
+				for (int c = 0; c < 256; ++ c) {
+					if (trans[s * 256 + c] < 0 && step(s, c) < 0) {
+						frozen = true;
+						return false;
+					}
+				}
+			}
+		}
+		frozen = true;
+		return true;
+	}
+
+	/**
+	 * The tables of a complete automaton: 256 successors of each state (0 is
+	 * the dead state, 1 the start one) and whether a state accepts. Returns
+	 * false when the automaton does not fit into MAX_STATES.
+	 */
+	bool tables(vector<int>& successors, vector<bool>& accepting) const {
+		if (!valid() || !complete()) return false;
+		for (size_t i = 256; i < trans.size(); ++ i) if (trans[i] < 0) return false;
+		successors = trans;
+		accepting = accept;
+		return true;
+	}
+
+private:
+	struct State {
+		enum Kind { SET, EPS, MATCH };
+		Kind        kind;
+		int         set;  // SET: index of a character set, MATCH: tag of a pattern
+		vector<int> out;  // SET: single successor, EPS: any number, in the order of priority
+		uint        pattern;
+	};
+
+	struct Node {
+		enum Kind { SET, CAT, ALT, REPEAT };
+		Kind        kind;
+		int         set;
+		vector<int> kids;
+		int         min;
+		int         max; // -1 is for infinity
+	};
+
+	/// Recursive descent parser of a pattern into a vector of nodes.
+	struct Parser {
+		Parser(const string& p, vector<Chars>& s) : pat(p), pos(0), sets(s), nodes() { }
+		int parse() {
+			int r = alt();
+			return pos == pat.size() ? r : -1;
+		}
+		int literal() {
+			int c = node(Node::CAT);
+			for (char x : pat) {
+				Chars cs;
+				cs.set(static_cast<unsigned char>(x));
+				int k = chars(cs);
+				nodes[c].kids.push_back(k);
+			}
+			return c;
+		}
+		int node(Node::Kind k, int set = -1) {
+			nodes.push_back(Node{k, set, {}, 0, 0});
+			return nodes.size() - 1;
+		}
+		int chars(const Chars& c) {
+			sets.push_back(c);
+			return node(Node::SET, sets.size() - 1);
+		}
+		int alt() {
+			int s = seq();
+			if (s < 0 || pos == pat.size() || pat[pos] != '|') return s;
+			int a = node(Node::ALT);
+			nodes[a].kids.push_back(s);
+			while (pos < pat.size() && pat[pos] == '|') {
+				++ pos;
+				if ((s = seq()) < 0) return -1;
+				nodes[a].kids.push_back(s);
+			}
+			return a;
+		}
+		int seq() {
+			int c = node(Node::CAT);
+			while (pos < pat.size() && pat[pos] != '|' && pat[pos] != ')') {
+				int r = repeat();
+				if (r < 0) return -1;
+				nodes[c].kids.push_back(r);
+			}
+			return c;
+		}
+		int repeat() {
+			int a = atom();
+			while (a >= 0 && pos < pat.size()) {
+				int min = 0, max = -1;
+				switch (pat[pos]) {
+				case '*': ++ pos; break;
+				case '+': ++ pos; min = 1; break;
+				case '?': ++ pos; max = 1; break;
+				case '{':
+					++ pos;
+					if (!number(min)) return -1;
+					max = min;
+					if (pos < pat.size() && pat[pos] == ',') {
+						++ pos;
+						max = -1;
+						if (pos < pat.size() && pat[pos] != '}' && !number(max)) return -1;
+					}
+					if (pos == pat.size() || pat[pos++] != '}') return -1;
+					if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min)) return -1;
+					break;
+				default: return a;
+				}
+				if (pos < pat.size() && pat[pos] == '?') return -1; // lazy quantifier
+				int r = node(Node::REPEAT);
+				nodes[r].kids.push_back(a);
+				nodes[r].min = min;
+				nodes[r].max = max;
+				a = r;
+			}
+			return a;
+		}
+		bool number(int& n) {
+			size_t b = pos;
+			n = 0;
+			while (pos < pat.size() && isdigit(static_cast<unsigned char>(pat[pos])) && pos - b < 4) n = n * 10 + (pat[pos++] - '0');
+			return pos > b;
+		}
+		int atom() {
+			char c = pat[pos++];
+			switch (c) {
+			case '(': {
+				if (pos < pat.size() && pat[pos] == '?') {
+					if (pos + 1 < pat.size() && pat[pos + 1] == ':') pos += 2;
+					else return -1;
+				}
+				int a = alt();
+				if (a < 0 || pos == pat.size() || pat[pos++] != ')') return -1;
+				return a;
+			}
+			case '[': return klass();
+			case '.': {
+				Chars cs;
+				cs.set();
+				cs.reset('\n');
+				cs.reset('\r');
+				return chars(cs);
+			}
+			case '\\': {
+				Chars cs;
+				return escape(cs) ? chars(cs) : -1;
+			}
+			case '^': case '$': case ')': case '*': case '+': case '?': case '{': case '|':
+				return -1;
+			default: {
+				Chars cs;
+				cs.set(static_cast<unsigned char>(c));
+				return chars(cs);
+			}
+			}
+		}
+		int klass() {
+			Chars cs;
+			bool neg = pos < pat.size() && pat[pos] == '^';
+			if (neg) ++ pos;
+			while (pos < pat.size() && pat[pos] != ']') {
+				int lo = -1;
+				Chars c;
+				if (pat[pos] == '\\') {
+					++ pos;
+					if (!escape(c)) return -1;
+					if (c.count() == 1) for (int i = 0; i < 256; ++ i) if (c[i]) lo = i;
+				} else {
+					lo = static_cast<unsigned char>(pat[pos++]);
+					c.set(lo);
+				}
+				if (lo >= 0 && pos + 1 < pat.size() && pat[pos] == '-' && pat[pos + 1] != ']') {
+					++ pos;
+					int hi = -1;
+					if (pat[pos] == '\\') {
+						++ pos;
+						Chars h;
+						if (!escape(h) || h.count() != 1) return -1;
+						for (int i = 0; i < 256; ++ i) if (h[i]) hi = i;
+					} else {
+						hi = static_cast<unsigned char>(pat[pos++]);
+					}
+					if (hi < lo) return -1;
+					for (int i = lo; i <= hi; ++ i) c.set(i);
+				}
+				cs |= c;
+			}
+			if (pos == pat.size()) return -1;
+			++ pos;
+			if (neg) cs.flip();
+			return chars(cs);
+		}
+		bool escape(Chars& cs) {
+			if (pos == pat.size()) return false;
+			char c = pat[pos++];
+			switch (c) {
+			case 'd': case 'D': for (int i = '0'; i <= '9'; ++ i) cs.set(i); break;
+			case 'w': case 'W':
+				for (int i = 0; i < 256; ++ i) if (isalnum(i) || i == '_') cs.set(i);
+				break;
+			case 's': case 'S': for (char x : string(" \t\n\v\f\r")) cs.set(x); break;
+			case 't': cs.set('\t'); return true;
+			case 'n': cs.set('\n'); return true;
+			case 'r': cs.set('\r'); return true;
+			case 'f': cs.set('\f'); return true;
+			case 'v': cs.set('\v'); return true;
+			case '0': cs.set(0); return true;
+			case 'x': {
+				if (pos + 2 > pat.size() || !isxdigit(static_cast<unsigned char>(pat[pos])) || !isxdigit(static_cast<unsigned char>(pat[pos + 1]))) return false;
+				cs.set(std::stoi(pat.substr(pos, 2), nullptr, 16));
+				pos += 2;
+				return true;
+			}
+			default:
+				if (isalnum(static_cast<unsigned char>(c))) return false; // \b, back references, etc.
+				cs.set(static_cast<unsigned char>(c));
+				return true;
+			}
+			if (isupper(static_cast<unsigned char>(c))) cs.flip();
+			return true;
+		}
+
+		const string&  pat;
+		size_t         pos;
+		vector<Chars>& sets;
+		vector<Node>   nodes;
+	};
+
+	int add(State::Kind k, int set = -1, vector<int> out = {}) {
+		nfa.push_back(State{k, set, out, 0});
+		return nfa.size() - 1;
+	}
+
+	/// Compiles a node so that it continues with the state next; returns the entry state.
+	int compile(const Parser& p, int n, int next) {
+		const Node& node = p.nodes[n];
+		switch (node.kind) {
+		case Node::SET: return add(State::SET, node.set, {next});
+		case Node::CAT:
+			for (auto it = node.kids.rbegin(); it != node.kids.rend(); ++ it) next = compile(p, *it, next);
+			return next;
+		case Node::ALT: {
+			vector<int> out;
+			for (int k : node.kids) out.push_back(compile(p, k, next));
+			return add(State::EPS, -1, out);
+		}
+		case Node::REPEAT: {
+			int kid = node.kids[0];
+			if (node.max < 0) {
+				int loop = add(State::EPS);
+				int body = compile(p, kid, loop);
+				nfa[loop].out = {body, next};
+				next = loop;
+			} else {
+				for (int i = node.min; i < node.max; ++ i) {
+					int body = compile(p, kid, next);
+					next = add(State::EPS, -1, {body, next});
+				}
+			}
+			for (int i = 0; i < node.min; ++ i) next = compile(p, kid, next);
+			return next;
+		}
+		}
+		return -1;
+	}
+
+	/**
+	 * Epsilon closure in the order of priority (the one of a backtracking search),
+	 * keeps only SET and MATCH states. The threads of a pattern after its MATCH
+	 * are dropped: they could only give a match, which that one wins over.
+	 */
+	vector<int> closure(const vector<int>& from) const {
+		vector<int> ret;
+		vector<bool> seen(nfa.size(), false);
+		vector<bool> matched(compiled.size(), false);
+		vector<int> todo(from.rbegin(), from.rend());
+		while (!todo.empty()) {
+			int s = todo.back();
+			todo.pop_back();
+			if (seen[s]) continue;
+			seen[s] = true;
+			const State& st = nfa[s];
+			if (st.kind == State::EPS) {
+				todo.insert(todo.end(), st.out.rbegin(), st.out.rend());
+			} else if (!matched[st.pattern]) {
+				ret.push_back(s);
+				if (st.kind == State::MATCH) matched[st.pattern] = true;
+			}
+		}
+		return ret;
+	}
+
+	int intern(const vector<int>& set) const {
+		auto it = index.find(set);
+		if (it != index.end()) return it->second;
+		if (states.size() >= MAX_STATES) return -1;
+		int id = states.size();
+		states.push_back(set);
+		index[set] = id;
+		trans.resize(trans.size() + 256, id ? -1 : 0);
+		tags.emplace_back();
+		for (int i : set) if (nfa[i].kind == State::MATCH) tags.back().push_back(nfa[i].set);
+		accept.push_back(!tags.back().empty());
+		return id;
+	}
+
+	int step(int s, unsigned char c) const {
+		if (frozen) return -1;
+		vector<int> next;
+		for (int i : states[s]) {
+			if (nfa[i].kind == State::SET && sets[nfa[i].set][c]) next.push_back(nfa[i].out[0]);
+		}
+		int n = intern(closure(next));
+		if (n >= 0) trans[s * 256 + c] = n;
+		return n;
+	}
+
+	vector<State> nfa;
+	vector<Chars> sets;
+	int           start;
+	vector<bool>  compiled; // which patterns made it into the automaton
+
+	// lazily built DFA: states are lists of NFA states, ordered by priority
+	mutable vector<int>         trans; // 256 successors per state, -1 when not built yet
+	mutable vector<vector<int>> states;
+	mutable map<vector<int>, int> index;
+	mutable vector<bool>        accept;
+	mutable vector<vector<uint>> tags; // accepted patterns
+	mutable bool                frozen; // no more states are built
+};
+
+}
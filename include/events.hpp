@@ -0,0 +1,113 @@
+#pragma once
+
+#include "expr.hpp"
+
+namespace dynaparse {
+
+/**
+ * Receives a parse as events in the order of the text, instead of a tree:
+ * enter and exit of each non-terminal and the tokens in between. Ids are
+ * those of the grammar: nonterm and symb are symbol ids, rule is Rule::id
+ * of the rule, which the non-terminal matched. Positions are the ones
+ * of the nodes, which the tree would have (enter gets the begin).
+ */
+struct Handler {
+	virtual ~Handler() { }
+	virtual void enter(uint nonterm, StrIter pos) = 0;
+	virtual void token(uint symb, StrIter beg, StrIter end) = 0;
+	virtual void exit(uint rule, StrIter beg, StrIter end) = 0;
+};
+
+/**
+ * Receives a parse, which is fed in chunks (see PushParser): the text, which
+ * the parse moved past, is released, so positions are offsets from the beginning
+ * of the stream. A token gets its text too, it is valid during the call only.
+ */
+struct StreamHandler {
+	virtual ~StreamHandler() { }
+	virtual void enter(uint nonterm, size_t pos) = 0;
+	virtual void token(uint symb, StrIter beg, StrIter end, size_t pos) = 0;
+	virtual void exit(uint rule, size_t beg, size_t end) = 0;
+};
+
+struct Event {
+	enum Kind : uint8_t { ENTER, TOKEN, EXIT };
+	Kind   kind;
+	uint   id;
+	size_t beg; // offsets of the text (see Input::offset)
+	size_t end;
+};
+
+/**
+ * Events of a parse, which are not delivered yet: while a backtrack entry
+ * is pending, they may still be dropped. The machine delivers them as soon
+ * as none is (see vm::COMMIT), so only the undecided part of the parse is
+ * kept, not its tree.
+ */
+struct Events {
+	Handler*       handler; // one of the two
+	StreamHandler* stream;
+	vector<Event>& pending;
+	StrIter        text;    // the text at the offset base, not released yet
+	size_t         base;
+	expr::Lexeme   span;    // the parsed text, the result of a successful parse
+
+	StrIter at(size_t offset) const { return text + (offset - base); }
+	void flush() {
+		for (const Event& e : pending) {
+			if (stream) {
+				switch (e.kind) {
+				case Event::ENTER: stream->enter(e.id, e.beg); break;
+				case Event::TOKEN: stream->token(e.id, at(e.beg), at(e.end), e.beg); break;
+				case Event::EXIT:  stream->exit(e.id, e.beg, e.end); break;
+				}
+				continue;
+			}
+			switch (e.kind) {
+			case Event::ENTER: handler->enter(e.id, at(e.beg)); break;
+			case Event::TOKEN: handler->token(e.id, at(e.beg), at(e.end)); break;
+			case Event::EXIT:  handler->exit(e.id, at(e.beg), at(e.end)); break;
+			}
+		}
+		pending.clear();
+	}
+};
+
+/**
+ * Semantic actions on the events: every token gets a value by shift, every
+ * matched rule reduces the values of its children to its own value. Only
+ * the values of the open non-terminals are kept.
+ */
+template<class Value>
+class Actions : public Handler {
+public:
+	typedef std::function<Value(uint symb, StrIter beg, StrIter end)> Shift;
+	typedef std::function<Value(uint rule, Value* kids, size_t n, StrIter beg, StrIter end)> Reduce;
+
+	Actions(Shift s, Reduce r) : shift(s), reduce(r), values(), frames() { }
+
+	void enter(uint, StrIter) override { frames.push_back(values.size()); }
+	void token(uint symb, StrIter beg, StrIter end) override { values.push_back(shift(symb, beg, end)); }
+	void exit(uint rule, StrIter beg, StrIter end) override {
+		size_t base = frames.back();
+		frames.pop_back();
+		Value v = reduce(rule, values.data() + base, values.size() - base, beg, end);
+		values.resize(base);
+		values.push_back(std::move(v));
+	}
+
+	/// The value of the start symbol, after a successful parse.
+	const Value& result() const { return values.back(); }
+	void clear() {
+		values.clear();
+		frames.clear();
+	}
+
+private:
+	Shift          shift;
+	Reduce         reduce;
+	vector<Value>  values;
+	vector<size_t> frames; // the first value of each open non-terminal
+};
+
+}
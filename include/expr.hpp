@@ -1,15 +1,57 @@
 #pragma once
 
 #include "syntagma.hpp"
+#include "arena.hpp"
 
 namespace dynaparse {
 
+/// Nodes carry a kind tag, so that traversals (see visit) need no dynamic_cast.
 struct Expr {
+	enum Kind : uint8_t { LEXEME, OPERATOR };
 	StrIter beg;
 	StrIter end;
-	Expr(StrIter b, StrIter e) : beg(b), end(e) { }
+	uint    refs; // number of owners: parent operators, memo tables, the caller
+	Kind    kind;
+	Expr(StrIter b, StrIter e, Kind k) : beg(b), end(e), refs(1), kind(k) { }
 	virtual ~Expr() {  }
 	virtual string show() const  = 0;
+	Expr* share() { ++refs; return this; }
+};
+
+inline void release(Expr* ex) {
+	if (!--ex->refs) delete ex;
+}
+
+/// Allocates an expression on heap or, if given, in an arena.
+template<class E, class... Args>
+E* create(ExprArena* arena, Args&&... args) {
+	if (!arena) return new E(std::forward<Args>(args)...);
+	return new (arena->alloc(sizeof(E), alignof(E))) E(std::forward<Args>(args)...);
+}
+
+/// Children passed to an operator: a vector or a part of a stack.
+struct ExprSpan {
+	ExprSpan(const vector<Expr*>& v) : data(v.data()), len(v.size()) { }
+	ExprSpan(Expr* const* d, uint n) : data(d), len(n) { }
+	Expr* const* data;
+	uint         len;
+};
+
+/// Children of an operator: an array on heap or in an arena.
+struct Exprs {
+	Exprs(ExprSpan v, ExprArena* arena) :
+		data(arena ? static_cast<Expr**>(arena->alloc(v.len * sizeof(Expr*), alignof(Expr*))) : new Expr*[v.len]),
+		len(v.len) {
+		std::copy(v.data, v.data + v.len, data);
+	}
+	Expr** begin() const { return data; }
+	Expr** end() const { return data + len; }
+	uint size() const { return len; }
+	bool empty() const { return !len; }
+	Expr* operator[] (uint i) const { return data[i]; }
+
+	Expr** data;
+	uint   len;
 };
 
 typedef Expr* (Semantic) (vector<Expr*>&);
@@ -17,48 +59,149 @@ typedef Expr* (Semantic) (vector<Expr*>&);
 namespace expr {
 
 struct Lexeme : public Expr {
-	Lexeme(StrIter b, StrIter e) : Expr(b, e) { }
+	Lexeme(StrIter b, StrIter e) : Expr(b, e, LEXEME) { }
 	virtual ~Lexeme() {  }
 	virtual string show() const { return string(beg, end); }
 };
 
+/**
+ * Operators allocated in an arena are never destroyed, so the destructor
+ * deals only with the heap allocated ones. It does not recurse: a tree
+ * may be as deep as the input is nested.
+ */
 struct Operator : public Expr {
-	Operator(const StrIter beg, StrIter end, const Rule* r, vector<Expr*> v) :
-		Expr(beg, end), nodes(v), rule(r) { }
-	virtual ~Operator() {
-		for (auto n : nodes) delete n;
-	}
-	vector<Expr*> nodes;
-	const Rule*   rule;
-	virtual string show() const {
-		assert(rule && "rule must be non nullptr");
-		if (!rule) return "null";
-		string ret;
-		for (auto n : nodes) ret += n->show();
-		return ret;
-	}
+	Operator(const StrIter beg, StrIter end, const Rule* r, ExprSpan v, ExprArena* arena = nullptr) :
+		Expr(beg, end, OPERATOR), nodes(v, arena), rule(r) { }
+	virtual ~Operator();
+	Exprs       nodes;
+	const Rule* rule; // nullptr in Indexed
+	/// The text of the lexemes.
+	virtual string show() const;
+	/// The rule id, also of an Indexed node.
+	uint rule_id() const;
 };
 
 struct Seq : public Operator {
-	Seq(const StrIter b, StrIter e, const Rule* r, vector<Expr*> v) : Operator(b, e, r, v) { }
+	Seq(const StrIter b, StrIter e, const Rule* r, ExprSpan v, ExprArena* a = nullptr) : Operator(b, e, r, v, a) { }
 };
 
 struct Iter : public Operator {
-	Iter(const StrIter b, StrIter e, const Rule* r, vector<Expr*> v) : Operator(b, e, r, v) { }
+	Iter(const StrIter b, StrIter e, const Rule* r, ExprSpan v, ExprArena* a = nullptr) : Operator(b, e, r, v, a) { }
 };
 
 struct Alt : public Operator {
-	Alt(const StrIter b, StrIter e, const Rule* r, vector<Expr*> v) : Operator(b, e, r, v) { }
+	Alt(const StrIter b, StrIter e, const Rule* r, ExprSpan v, ExprArena* a = nullptr) : Operator(b, e, r, v, a) { }
 };
 
 struct Opt : public Operator {
-	Opt(const StrIter b, StrIter e, const Rule* r, vector<Expr*> v) : Operator(b, e, r, v) { }
+	Opt(const StrIter b, StrIter e, const Rule* r, ExprSpan v, ExprArena* a = nullptr) : Operator(b, e, r, v, a) { }
 };
 
+/// Node of a rule known by its id only (see Rule::id): parsed without the grammar, from an Image.
+struct Indexed : public Operator {
+	Indexed(const StrIter b, StrIter e, uint i, ExprSpan v, ExprArena* a = nullptr) : Operator(b, e, nullptr, v, a), id(i) { }
+	uint id;
+};
+
+inline uint Operator::rule_id() const { return rule ? rule->id : static_cast<const Indexed*>(this)->id; }
+
+/// The children, which lose their last owner, give theirs to the list before they are deleted.
+inline Operator::~Operator() {
+	vector<Expr*> orphans(nodes.begin(), nodes.end());
+	delete[] nodes.data;
+	while (!orphans.empty()) {
+		Expr* ex = orphans.back();
+		orphans.pop_back();
+		if (-- ex->refs) continue;
+		if (ex->kind == OPERATOR) {
+			Operator* op = static_cast<Operator*>(ex);
+			orphans.insert(orphans.end(), op->nodes.begin(), op->nodes.end());
+			op->nodes.len = 0;
+		}
+		delete ex;
+	}
+}
+
 } // namespace expr
 
-ostream& operator << (ostream& os, const Expr& ex) {
-	os << ex.show(); return os;
+/**
+ * Depth-first traversal of a tree, without recursion: the visitor is called
+ * as v.enter(node, depth) before the children of a node and v.leave(node, depth)
+ * after them (the same as FlatTree::visit); when enter returns false
+ * the children are skipped.
+ */
+template<class Visitor>
+void visit(const Expr& root, Visitor& v) {
+	struct Item { const Expr* node; uint child; uint size; };
+	auto size = [](const Expr& e) { return e.kind == Expr::OPERATOR ? static_cast<const expr::Operator&>(e).nodes.size() : 0u; };
+	vector<Item> path{Item{&root, 0, size(root)}};
+	if (!v.enter(root, 0)) path.back().child = path.back().size;
+	while (!path.empty()) {
+		Item& top = path.back();
+		if (top.child == top.size) {
+			v.leave(*top.node, path.size() - 1);
+			path.pop_back();
+			continue;
+		}
+		const Expr* n = static_cast<const expr::Operator*>(top.node)->nodes[top.child ++];
+		uint depth = path.size();
+		path.push_back(Item{n, 0, size(*n)});
+		if (!v.enter(*n, depth)) path.back().child = path.back().size;
+	}
+}
+
+/// Writes the text of the lexemes of a tree.
+template<class Out>
+void write_text(Out& out, const Expr& root) {
+	struct Text {
+		bool enter(const Expr& e, uint) {
+			if (e.kind == Expr::LEXEME) out.write(e.beg, e.end - e.beg);
+			return true;
+		}
+		void leave(const Expr&, uint) { }
+		Out& out;
+	} t{out};
+	visit(root, t);
+}
+
+/// Output of the writers into a stream.
+struct StreamOut {
+	void write(const char* s, size_t n) { os.write(s, n); }
+	ostream& os;
+};
+
+/// Output of the writers appended to a string.
+struct StringOut {
+	void write(const char* s, size_t n) { str.append(s, n); }
+	string& str;
+};
+
+/**
+ * Output of the writers into a buffer of the caller: what does not fit is
+ * cut off, but counted, so len tells the size needed (as with snprintf).
+ */
+struct BufferOut {
+	void write(const char* s, size_t n) {
+		if (len < size) std::memcpy(data + len, s, std::min(n, size - len));
+		len += n;
+	}
+	bool fits() const { return len <= size; }
+	char*  data;
+	size_t size;
+	size_t len;
+};
+
+inline string expr::Operator::show() const {
+	string ret;
+	StringOut out{ret};
+	write_text(out, *this);
+	return ret;
+}
+
+inline ostream& operator << (ostream& os, const Expr& ex) {
+	StreamOut out{os};
+	write_text(out, ex);
+	return os;
 }
 
 }
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "expr.hpp"
+
+namespace dynaparse {
+
+/**
+ * Compact parse tree: all nodes in one array, in breadth-first order, so
+ * that the children of a node are contiguous. A node keeps the id of its
+ * rule (see Rule::id) and offsets into the source instead of pointers,
+ * so a tree is plain data and may be copied or moved between threads.
+ */
+struct FlatTree {
+	enum { LEXEME = uint(-1) }; // rule id of a terminal node
+
+	struct Node {
+		uint rule;  // rule id or LEXEME
+		uint beg;   // offsets of the matched text in the source
+		uint end;
+		uint first; // index of the first child
+		uint size;  // number of children
+		bool lexeme() const { return rule == LEXEME; }
+	};
+
+	FlatTree() : nodes() { }
+	/// Flattens a parse tree, the offsets are counted from origin.
+	FlatTree(const Expr* root, StrIter origin) : nodes() { assign(root, origin); }
+
+	void assign(const Expr* root, StrIter origin) {
+		nodes.clear();
+		vector<const Expr*> exprs;
+		if (!root) return;
+		exprs.push_back(root);
+		for (size_t i = 0; i < exprs.size(); ++ i) {
+			const Expr* ex = exprs[i];
+			Node n{LEXEME, uint(ex->beg - origin), uint(ex->end - origin), uint(exprs.size()), 0};
+			if (ex->kind == Expr::OPERATOR) {
+				const expr::Operator* op = static_cast<const expr::Operator*>(ex);
+				n.rule = op->rule_id();
+				n.size = op->nodes.size();
+				exprs.insert(exprs.end(), op->nodes.begin(), op->nodes.end());
+			}
+			nodes.push_back(n);
+		}
+	}
+
+	/**
+	 * Builds a tree while the bytecode parses (see vm::run), without Expr nodes:
+	 * a node is made when its token is matched or its rule accepted. The nodes
+	 * of the open non-terminals are on a stack, an accepted rule moves its
+	 * children into a block of done, so a failed branch is dropped by cutting
+	 * both back. Memory of a parse is the nodes, not their expressions.
+	 */
+	struct Builder {
+		Builder() : open(), done(), span(nullptr, nullptr) { }
+		void clear() {
+			open.clear();
+			done.clear();
+		}
+		void lexeme(size_t beg, size_t end) { open.push_back(Node{LEXEME, uint(beg), uint(end), 0, 0}); }
+		/// The children of the rule are on the stack from base.
+		void accept(uint rule, size_t beg, size_t end, size_t base) {
+			Node n{rule, uint(beg), uint(end), uint(done.size()), uint(open.size() - base)};
+			done.insert(done.end(), open.begin() + base, open.end());
+			open.resize(base);
+			open.push_back(n);
+		}
+		void rollback(size_t o, size_t d) {
+			open.resize(o);
+			done.resize(d);
+		}
+		/// Puts the tree of the node on the top into out, in breadth-first order.
+		void finish(FlatTree& out) const {
+			out.nodes.assign(1, open.back());
+			for (size_t i = 0; i < out.nodes.size(); ++ i) {
+				uint first = out.nodes[i].first;
+				out.nodes[i].first = out.nodes.size();
+				out.nodes.insert(out.nodes.end(), done.begin() + first, done.begin() + first + out.nodes[i].size);
+			}
+		}
+
+		vector<Node> open;
+		vector<Node> done;
+		expr::Lexeme span; // the parsed text, the result of a successful parse
+	};
+
+	bool empty() const { return nodes.empty(); }
+	uint size() const { return nodes.size(); }
+	const Node& root() const { return nodes[0]; }
+	const Node& operator[] (uint i) const { return nodes[i]; }
+	const Node* begin(const Node& n) const { return nodes.data() + n.first; }
+	const Node* end(const Node& n) const { return nodes.data() + n.first + n.size; }
+	string text(const Node& n, const string& src) const { return src.substr(n.beg, n.end - n.beg); }
+
+	/**
+	 * Depth-first traversal. The visitor is called as v.enter(node, depth)
+	 * before the children of a node and v.leave(node, depth) after them;
+	 * when enter returns false the children are skipped.
+	 */
+	template<class Visitor>
+	void visit(Visitor& v) const {
+		if (empty()) return;
+		struct Item { const Node* node; uint child; };
+		vector<Item> path{Item{&root(), 0}};
+		if (!v.enter(root(), 0)) path.back().child = root().size;
+		while (!path.empty()) {
+			Item& top = path.back();
+			if (top.child == top.node->size) {
+				v.leave(*top.node, path.size() - 1);
+				path.pop_back();
+				continue;
+			}
+			const Node* n = begin(*top.node) + top.child ++;
+			path.push_back(Item{n, v.enter(*n, path.size()) ? 0 : n->size});
+		}
+	}
+
+	/// Same as Expr::show: the text of all lexemes.
+	string show(const string& src) const {
+		struct Show {
+			bool enter(const Node& n, uint) {
+				if (n.lexeme()) ret.append(src, n.beg, n.end - n.beg);
+				return true;
+			}
+			void leave(const Node&, uint) { }
+			const string& src;
+			string ret;
+		} s{src, string()};
+		visit(s);
+		return s.ret;
+	}
+
+	vector<Node> nodes;
+};
+
+}
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "symb.hpp"
+#include "blanks.hpp"
 
 namespace dynaparse {
 
@@ -17,25 +17,30 @@ struct Rule {
 	~ Rule();
 	rule::Ref* left;
 	Syntagma*  right;
+	uint       id;    // index in Grammar::rules
 	string show() const;
 	Rule* clone() const;
 	Rule* clone(map<Syntagma*, Syntagma*>&) const;
 };
 
-typedef bool (Skipper) (char);
-
 inline void skip(Skipper* skipper, StrIter& ch, StrIter end){
 	while (ch != end && skipper(*ch)) ++ch;
 }
 
 struct Grammar {
+	struct KeyHash {
+		size_t operator() (const pair<int, string>& k) const { return std::hash<string>()(k.second) * 3 + k.first; }
+	};
 	string             name;
-	map<string, Symb*> symb_map;
+	unordered_map<string, Symb*> symb_map;
 	vector<Symb*>      symbs;
+	unordered_map<pair<int, string>, uint, KeyHash> symb_ids; // kind and key of a symbol to its id
 	vector<Rule*>      rules;
-	set<rule::Operator*> to_flaten;
-	Skipper*           skipper;
+	size_t             flat; // the rules before are flattened
+	Skipper*           skipper;  // set with set_skipper
+	vector<Comment>    comments; // skipped as the skipper's chars, set with set_comments
 	int                fresh_nonterm_index;
+	uint64_t           revision; // counts the changes, see changed()
 
 	Grammar& operator << (Symb* s);
 	Grammar& operator << (Rule&& rule);
@@ -45,6 +50,22 @@ struct Grammar {
 	}
 
 	void add(Rule* r);
+	/// Deletes a rule, the ids of the following rules shift down.
+	void remove(Rule* r);
+	/**
+	 * Marks the grammar as changed, so that its fingerprint is computed anew.
+	 * The methods, which change it, call it; a direct change of the members
+	 * must call it too.
+	 */
+	void changed() { ++ revision; }
+	void set_skipper(Skipper* s) {
+		skipper = s;
+		changed();
+	}
+	void set_comments(const vector<Comment>& cs) {
+		comments = cs;
+		changed();
+	}
 
 	string show(bool full = true) const {
 		string ret;
@@ -52,6 +73,7 @@ struct Grammar {
 			ret += "Grammar " + name + "\n";
 			ret += "--------------------\n";
 			for (auto symb : symbs) ret += symb->show() + "\n";
+			for (const Comment& c : comments) ret += "Comment: " + c.open + " ... " + c.close + "\n";
 			ret += "\n";
 		}
 		for (auto rule : rules) ret += rule->show() + "\n";
@@ -65,6 +87,8 @@ struct Grammar {
 	}
 
 	void flaten_ebnf();
+	Grammar* clone() const;
+	uint64_t fingerprint() const;
 
 	symb::Nonterm* fresh_nonterm() {
 		string nn = "N_" + std::to_string(fresh_nonterm_index++);
@@ -72,6 +96,14 @@ struct Grammar {
 		operator << (nt);
 		return nt;
 	}
+
+private:
+	struct Fingerprint {
+		std::mutex mutex;
+		uint64_t   revision;
+		uint64_t   value;
+	};
+	mutable Fingerprint fp; // cached for the revision
 };
 
 }
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "parser.hpp"
+
+namespace dynaparse {
+
+/**
+ * A compiled grammar in a file: the bytecode of a Parser (see vm::Program)
+ * with the tables it needs to match terminals, in a position independent
+ * layout (offsets from the start of the file). Loading maps the file and
+ * checks its header, nothing is allocated per rule or symbol, so a worker
+ * parses at once, without building the Grammar.
+ *
+ * Parse trees are FlatTree, their nodes refer to rules by id (see Rule::id),
+ * left() names the non-terminal of a rule. The skipper is stored as the set
+ * of characters it skips, the comments as pairs of delimiters. Regexps, which the DFA does not support, are kept
+ * as patterns and compiled with std::regex on loading. The file follows the
+ * byte order and the type sizes of the machine, which wrote it, the header
+ * rejects other ones.
+ */
+class Image {
+public:
+	enum { FORMAT = 3, ORDER = 0x01020304, NO_DFA = uint32_t(-1) };
+	enum Part { CODE, ENTRIES, SETS, DISPATCH, TERMINALS, RULES, TREES, RULE_TREES, DFAS, TRANS, ACCEPT, COMMENTS, STRINGS, PARTS };
+
+	struct Section {
+		uint64_t offset;
+		uint64_t count;
+	};
+	struct Header {
+		char     magic[8];
+		uint32_t format;
+		uint32_t order;
+		uint32_t instr_size;
+		uint32_t reserved;
+		uint64_t fingerprint; // of the grammar, see Grammar::fingerprint
+		uint64_t size;        // of the file
+		uint64_t skip[4];     // characters the skipper skips
+		Section  sections[PARTS];
+	};
+	struct Text {
+		uint32_t offset; // in STRINGS
+		uint32_t len;
+	};
+	struct Terminal {
+		uint32_t kind;
+		uint32_t id;
+		Text     text;   // keyword body or regexp pattern
+		uint32_t dfa;    // REGEXP: index in DFAS or NO_DFA
+	};
+	struct Automaton {
+		uint32_t trans;  // first successor in TRANS, 256 per state
+		uint32_t accept; // first flag in ACCEPT
+	};
+
+	/// Writes the compiled grammar of a parser.
+	static void write(const Parser& p, ostream& os);
+
+	Image(const string& path);
+	Image(const Image&) = delete;
+	Image& operator = (const Image&) = delete;
+
+	/// Parses into a compact tree, returns false when the source is not parsed.
+	bool parse(Source src, const string& type, FlatTree& out, bool packrat = false) const;
+
+	uint64_t fingerprint() const { return header->fingerprint; }
+	uint rules() const { return header->sections[RULE_TREES].count; }
+	/// The non-terminal on the left side of a rule.
+	string left(uint rule) const { return text(trees[rule_trees[rule]]); }
+
+	size_t memo_limit; // upper bound for the packrat memo table in bytes
+
+	/// Input of the machine: characters, skipped by the stored blanks.
+	struct Input {
+		typedef StrIter Pos;
+		void skip(Pos& p) const { if (p != last && blanks.starts(*p)) blanks.skip(p, last); }
+		uint peek(Pos p) const { return p == last ? uint(Analysis::END) : static_cast<unsigned char>(*p); }
+		void    touch(size_t) const { }
+		bool    starved() const { return false; }
+		size_t  offset(Pos p) const { return p - origin; }
+		Pos     at(size_t o) const { return origin + o; }
+		StrIter beg(Pos p) const { return p; }
+		StrIter end(Pos, Pos p) const { return p; }
+
+		StrIter       origin;
+		StrIter       last;
+		const Blanks& blanks;
+	};
+
+	// the tables, as vm::run reads them
+	const vm::Instr* instrs() const { return code; }
+	uint entry(uint tree) const { return entries[tree]; }
+	bool test(uint set, uint c) const { return sets[set * 5 + (c >> 6)] >> (c & 63) & 1; }
+	uint jump(uint table, uint c) const { return dispatch[table * vm::Program::TABLE + c]; }
+	const void* key(uint tree) const { return entries + tree; }
+	bool match(const Input& in, uint terminal, StrIter& pos) const;
+	Expr* accept(ExprArena* arena, StrIter b, StrIter e, uint rule, ExprSpan kids) const {
+		return create<expr::Indexed>(arena, b, e, rules_of[rule], kids, arena);
+	}
+	uint rule_id(uint rule) const { return rules_of[rule]; }
+
+private:
+	template<class T>
+	const T* at(Part p) const { return reinterpret_cast<const T*>(file.data() + header->sections[p].offset); }
+	string text(Text t) const { return string(strings + t.offset, t.len); }
+	uint tree(const string& type) const;
+	uint64_t count(Part p) const { return header->sections[p].count; }
+	bool valid() const;
+
+	MappedFile        file;
+	const Header*     header;
+	const vm::Instr*  code;
+	const uint32_t*   entries;
+	const uint64_t*   sets;
+	const uint32_t*   dispatch;
+	const Terminal*   terminals;
+	const uint32_t*   rules_of;   // rule id of an ACCEPT
+	const Text*       trees;      // names of the non-terminals, sorted
+	const uint32_t*   rule_trees; // non-terminal of a rule
+	const Automaton*  dfas;
+	const int32_t*    trans;
+	const uint8_t*    accepting;
+	const char*       strings;
+	unordered_map<uint, std::regex> fallback; // by terminal
+	std::unique_ptr<const Blanks>   blanks;
+};
+
+void Image::write(const Parser& p, ostream& os) {
+	vm::Program prog; // without the dead code, which updates of the parser leave
+	vm::compile(prog, p.trees);
+	string strings;
+	auto text = [&strings](const string& s) {
+		Text t{uint32_t(strings.size()), uint32_t(s.size())};
+		strings += s;
+		return t;
+	};
+	vector<vm::Instr> code(prog.code.size());
+	std::memset(code.data(), 0, code.size() * sizeof(vm::Instr)); // no garbage in the padding
+	for (size_t i = 0; i < code.size(); ++ i) {
+		code[i].op = prog.code[i].op;
+		code[i].arg = prog.code[i].arg;
+		code[i].alt = prog.code[i].alt;
+	}
+	vector<uint32_t> entries(prog.entries.begin(), prog.entries.end());
+	vector<uint64_t> sets(prog.sets.size() * 5, 0);
+	for (size_t k = 0; k < prog.sets.size(); ++ k) {
+		for (uint c = 0; c <= Analysis::END; ++ c) if (prog.sets[k][c]) sets[k * 5 + (c >> 6)] |= uint64_t(1) << (c & 63);
+	}
+	vector<uint32_t> dispatch(prog.dispatch.begin(), prog.dispatch.end());
+	vector<Terminal> terminals;
+	vector<Automaton> dfas;
+	vector<int32_t> trans;
+	vector<uint8_t> accepting;
+	map<uint, uint32_t> dfa_of; // by symbol id
+	for (const parser::Node* n : prog.terminals) {
+		Terminal t{n->kind, n->id, text(n->symb->key()), NO_DFA};
+		if (n->kind == Symb::REGEXP) {
+			auto it = dfa_of.find(n->id);
+			if (it == dfa_of.end()) {
+				vector<int> tr;
+				vector<bool> acc;
+				uint32_t index = NO_DFA;
+				if (static_cast<const symb::Regexp*>(n->symb)->dfa.tables(tr, acc)) {
+					index = dfas.size();
+					dfas.push_back(Automaton{uint32_t(trans.size()), uint32_t(accepting.size())});
+					trans.insert(trans.end(), tr.begin(), tr.end());
+					accepting.insert(accepting.end(), acc.begin(), acc.end());
+				}
+				it = dfa_of.emplace(n->id, index).first;
+			}
+			t.dfa = it->second;
+		}
+		terminals.push_back(t);
+	}
+	vector<uint32_t> rules_of;
+	for (const Rule* r : prog.rules) rules_of.push_back(r->id);
+	vector<Text> trees;
+	for (auto& t : p.trees) trees.push_back(text(t.first));
+	vector<uint32_t> rule_trees;
+	for (const Rule* r : p.grammar.rules) rule_trees.push_back(prog.index.at(&p.trees.at(r->left->ref->name)));
+	vector<Text> comments;
+	for (const Comment& c : p.blanks.delimiters()) {
+		comments.push_back(text(c.open));
+		comments.push_back(text(c.close));
+	}
+
+	Header h;
+	std::memset(&h, 0, sizeof(h));
+	std::memcpy(h.magic, "DYNAPARS", 8);
+	h.format = FORMAT;
+	h.order = ORDER;
+	h.instr_size = sizeof(vm::Instr);
+	h.fingerprint = p.grammar.fingerprint();
+	std::memcpy(h.skip, p.blanks.table(), sizeof(h.skip));
+	string body;
+	auto put = [&h, &body](Part part, const void* data, size_t count, size_t elem) {
+		body.resize((body.size() + 7) & ~size_t(7), '\0');
+		h.sections[part] = Section{sizeof(Header) + body.size(), count};
+		body.append(static_cast<const char*>(data), count * elem);
+	};
+	put(CODE, code.data(), code.size(), sizeof(vm::Instr));
+	put(ENTRIES, entries.data(), entries.size(), sizeof(uint32_t));
+	put(SETS, sets.data(), sets.size(), sizeof(uint64_t));
+	put(DISPATCH, dispatch.data(), dispatch.size(), sizeof(uint32_t));
+	put(TERMINALS, terminals.data(), terminals.size(), sizeof(Terminal));
+	put(RULES, rules_of.data(), rules_of.size(), sizeof(uint32_t));
+	put(TREES, trees.data(), trees.size(), sizeof(Text));
+	put(RULE_TREES, rule_trees.data(), rule_trees.size(), sizeof(uint32_t));
+	put(DFAS, dfas.data(), dfas.size(), sizeof(Automaton));
+	put(TRANS, trans.data(), trans.size(), sizeof(int32_t));
+	put(ACCEPT, accepting.data(), accepting.size(), sizeof(uint8_t));
+	put(COMMENTS, comments.data(), comments.size(), sizeof(Text));
+	put(STRINGS, strings.data(), strings.size(), sizeof(char));
+	h.size = sizeof(Header) + body.size();
+	os.write(reinterpret_cast<const char*>(&h), sizeof(h));
+	os.write(body.data(), body.size());
+}
+
+Image::Image(const string& path) : memo_limit(64 << 20), file(path), header(reinterpret_cast<const Header*>(file.data())) {
+	static const size_t sizes[PARTS] = {
+		sizeof(vm::Instr), sizeof(uint32_t), sizeof(uint64_t), sizeof(uint32_t), sizeof(Terminal), sizeof(uint32_t),
+		sizeof(Text), sizeof(uint32_t), sizeof(Automaton), sizeof(int32_t), sizeof(uint8_t), sizeof(Text), sizeof(char)
+	};
+	bool ok = file.size() >= sizeof(Header) && !std::memcmp(header->magic, "DYNAPARS", 8) && header->format == FORMAT &&
+		header->order == ORDER && header->instr_size == sizeof(vm::Instr) && header->size == file.size();
+	for (uint p = 0; ok && p < PARTS; ++ p) {
+		const Section& s = header->sections[p];
+		ok = s.offset % 8 == 0 && s.offset <= file.size() && s.count <= (file.size() - s.offset) / sizes[p];
+	}
+	if (!ok) {
+		std::cerr << "file " << path << " is not a compiled grammar of this version" << std::endl;
+		throw std::exception();
+	}
+	code = at<vm::Instr>(CODE);
+	entries = at<uint32_t>(ENTRIES);
+	sets = at<uint64_t>(SETS);
+	dispatch = at<uint32_t>(DISPATCH);
+	terminals = at<Terminal>(TERMINALS);
+	rules_of = at<uint32_t>(RULES);
+	trees = at<Text>(TREES);
+	rule_trees = at<uint32_t>(RULE_TREES);
+	dfas = at<Automaton>(DFAS);
+	trans = at<int32_t>(TRANS);
+	accepting = at<uint8_t>(ACCEPT);
+	strings = at<char>(STRINGS);
+	if (!valid()) {
+		std::cerr << "file " << path << " is a corrupt compiled grammar" << std::endl;
+		throw std::exception();
+	}
+	const Text* delims = at<Text>(COMMENTS);
+	vector<Comment> comments;
+	for (uint i = 0; i + 1 < header->sections[COMMENTS].count; i += 2) comments.push_back(Comment{text(delims[i]), text(delims[i + 1])});
+	blanks.reset(new Blanks(header->skip, comments));
+	for (uint t = 0; t < header->sections[TERMINALS].count; ++ t) {
+		if (terminals[t].kind == Symb::REGEXP && terminals[t].dfa == NO_DFA) fallback.emplace(t, std::regex(text(terminals[t].text)));
+	}
+}
+
+/**
+ * The tables refer to each other only within their bounds: the machine
+ * and match() read them unchecked. The targets of jumps and calls, the
+ * set, table, terminal and rule of each instruction, the states of the DFA
+ * tables and the texts are checked, and that a COMMIT pops no more choices
+ * than the code of its trie opened on the way to it.
+ */
+bool Image::valid() const {
+	uint64_t n = count(CODE);
+	if (n < 2 || count(SETS) % 5 || count(DISPATCH) % vm::Program::TABLE) return false;
+	for (uint64_t pc = 0; pc < n; ++ pc) {
+		const vm::Instr& i = code[pc];
+		bool next = true; // goes on with pc + 1
+		switch (i.op) {
+		case vm::SKIP:     break;
+		case vm::DISPATCH: next = false; if (i.arg >= count(DISPATCH) / vm::Program::TABLE) return false; break;
+		case vm::CHOICE:   if (i.arg >= n) return false; break;
+		case vm::TEST:     if (i.arg >= count(SETS) / 5 || i.alt >= n) return false; break;
+		case vm::MATCH:    if (i.arg >= count(TERMINALS)) return false; break;
+		case vm::CALL:     if (i.arg >= count(ENTRIES)) return false; break;
+		case vm::ACCEPT:   next = false; if (i.arg >= count(RULES)) return false; break;
+		case vm::FAIL:
+		case vm::HALT:     next = false; break;
+		case vm::COMMIT:   break;
+		default:           return false;
+		}
+		if (next && pc + 1 >= n) return false;
+	}
+	for (uint64_t i = 0; i < count(ENTRIES); ++ i) if (entries[i] >= n) return false;
+	for (uint64_t i = 0; i < count(DISPATCH); ++ i) if (dispatch[i] >= n) return false;
+	// the choices open at each instruction, a shared target may only end the trie
+	vector<uint64_t> open(n, uint64_t(-1));
+	vector<uint64_t> work;
+	auto reach = [this, &open, &work](uint64_t pc, uint64_t d) {
+		if (open[pc] == uint64_t(-1)) {
+			open[pc] = d;
+			work.push_back(pc);
+		}
+		return open[pc] == d || code[pc].op == vm::FAIL || code[pc].op == vm::HALT;
+	};
+	for (uint64_t i = 0; i < count(ENTRIES); ++ i) if (!reach(entries[i], 0)) return false;
+	while (!work.empty()) {
+		uint64_t pc = work.back(), d = open[pc];
+		work.pop_back();
+		const vm::Instr& i = code[pc];
+		bool ok = true;
+		switch (i.op) {
+		case vm::DISPATCH:
+			for (uint c = 0; c < vm::Program::TABLE; ++ c) ok &= reach(dispatch[i.arg * vm::Program::TABLE + c], d);
+			break;
+		case vm::CHOICE: ok = reach(i.arg, d) && reach(pc + 1, d + 1); break;
+		case vm::TEST:   ok = reach(i.alt, d) && reach(pc + 1, d); break;
+		case vm::COMMIT: ok = i.arg <= d && reach(pc + 1, d - i.arg); break;
+		case vm::ACCEPT:
+		case vm::FAIL:
+		case vm::HALT:   break;
+		default:         ok = reach(pc + 1, d); break;
+		}
+		if (!ok) return false;
+	}
+	for (uint64_t i = 0; i < count(RULES); ++ i) if (rules_of[i] >= count(RULE_TREES)) return false;
+	for (uint64_t i = 0; i < count(RULE_TREES); ++ i) if (rule_trees[i] >= count(TREES)) return false;
+	auto inside = [this](Text t) { return t.offset <= count(STRINGS) && t.len <= count(STRINGS) - t.offset; };
+	for (uint64_t i = 0; i < count(TREES); ++ i) if (!inside(trees[i])) return false;
+	const Text* delims = at<Text>(COMMENTS);
+	for (uint64_t i = 0; i < count(COMMENTS); ++ i) if (!inside(delims[i])) return false;
+	for (uint64_t i = 0; i < count(TERMINALS); ++ i) {
+		const Terminal& t = terminals[i];
+		if ((t.kind != Symb::KEYWORD && t.kind != Symb::REGEXP) || !inside(t.text)) return false;
+		if (t.kind == Symb::REGEXP && t.dfa != NO_DFA && t.dfa >= count(DFAS)) return false;
+	}
+	// the automata follow each other in TRANS and ACCEPT, the start state is 1
+	for (uint64_t d = 0; d < count(DFAS); ++ d) {
+		uint64_t tb = dfas[d].trans, te = d + 1 < count(DFAS) ? dfas[d + 1].trans : count(TRANS);
+		uint64_t ab = dfas[d].accept, ae = d + 1 < count(DFAS) ? dfas[d + 1].accept : count(ACCEPT);
+		if (tb > te || te > count(TRANS) || ab > ae || ae > count(ACCEPT)) return false;
+		uint64_t states = ae - ab;
+		if (states < 2 || te - tb != states * 256) return false;
+		for (uint64_t i = tb; i < te; ++ i) if (trans[i] < 0 || uint64_t(trans[i]) >= states) return false;
+	}
+	return true;
+}
+
+/// Same as CharInput::match: keywords are compared, regexps run their DFA tables.
+bool Image::match(const Input& in, uint terminal, StrIter& pos) const {
+	const Terminal& t = terminals[terminal];
+	if (t.kind == Symb::KEYWORD) {
+		if (size_t(in.last - pos) < t.text.len || std::memcmp(pos, strings + t.text.offset, t.text.len)) return false;
+		pos += t.text.len;
+		return true;
+	}
+	int len = -1;
+	if (t.dfa != NO_DFA) {
+		const int32_t* tr = trans + dfas[t.dfa].trans;
+		const uint8_t* acc = accepting + dfas[t.dfa].accept;
+		int s = 1;
+		len = acc[1] ? 0 : -1;
+		for (StrIter p = pos; p != in.last; ++ p) {
+			s = tr[s * 256 + static_cast<unsigned char>(*p)];
+			if (!s) break;
+			if (acc[s]) len = p - pos + 1;
+		}
+	} else {
+		std::cmatch m;
+		if (std::regex_search(pos, in.last, m, fallback.at(terminal), std::regex_constants::match_continuous)) len = m.length();
+	}
+	if (len < 0) return false;
+	pos += len;
+	return true;
+}
+
+uint Image::tree(const string& type) const {
+	const Text* b = trees;
+	const Text* e = trees + header->sections[TREES].count;
+	const Text* it = std::lower_bound(b, e, type, [this](const Text& t, const string& s) {
+		return s.compare(0, s.size(), strings + t.offset, t.len) > 0;
+	});
+	if (it == e || text(*it) != type) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
+	}
+	return it - b;
+}
+
+bool Image::parse(Source src, const string& type, FlatTree& out, bool packrat) const {
+	uint t = tree(type);
+	ParseContext& ctx = ParseContext::local();
+	parser::Memo memo(memo_limit, &ctx.arena);
+	Input in{src.beg, src.end, *blanks};
+	StrIter pos = src.beg;
+	// without memo the nodes are built as the parse goes
+	parser::Context c{packrat ? &memo : nullptr, packrat ? &ctx.arena : nullptr, nullptr, packrat ? nullptr : &ctx.flat};
+	Expr* ex = vm::run(*this, t, in, pos, c, ctx.vm_chars);
+	if (ex) in.skip(pos);
+	if (!ex || pos != src.end) out.nodes.clear();
+	else if (packrat) out.assign(ex, src.beg);
+	else ctx.flat.finish(out);
+	ctx.arena.clear();
+	return !out.empty();
+}
+
+}
@@ -0,0 +1,264 @@
+#pragma once
+
+#include "parser.hpp"
+
+namespace dynaparse {
+
+/**
+ * Reparses a source after edits, reusing the subtrees of the previous parse,
+ * which the edits can't change. Every node of a parse remembers its reach:
+ * one past the last char read while it was parsed (the length plus one,
+ * if the end of the source was seen). A non-terminal parses the same
+ * wherever its text is the same, so a node is clean when no edit is within
+ * its beginning and its reach: it is shifted by the edits before it.
+ * The maximal clean nodes under the paths to the edits are put into the packrat
+ * memo at their new positions and the bytecode runs again: it stops at them,
+ * so the work grows with the edited part of the tree, not with the source.
+ * The reused subtrees are copied into the new tree in one pass.
+ *
+ * The reach is conservative: a node gets the furthest char read by the whole
+ * parse so far, so a node parsed after a long failed alternative is reused
+ * less often. Only character input is supported (no lexer) and the grammar
+ * must not change between the parses.
+ */
+class IncrementalParser {
+public:
+	/// A change of the previous source: removed chars at offset are replaced by inserted.
+	struct Edit {
+		uint   offset;
+		uint   removed;
+		string inserted;
+	};
+
+	IncrementalParser(const Parser& p, const string& type);
+
+	/// Parses a source from scratch, returns false when it is not parsed.
+	bool parse(Source src);
+	/**
+	 * Parses the source, which the edits (sorted, not overlapping, offsets into
+	 * the previous source) made of the previous one. Without a previous tree
+	 * it parses from scratch.
+	 */
+	bool reparse(Source src, const vector<Edit>& edits);
+
+	/// The tree of the last parse, empty if it failed.
+	const FlatTree& tree() const { return flat; }
+	/// The reach of a node of the tree.
+	size_t reach(uint node) const { return reaches[node]; }
+	/// The nodes of the tree, which the last parse copied from the previous one.
+	uint reused() const { return copied; }
+
+	/// Applies edits to a text.
+	static string apply(const string& text, const vector<Edit>& edits);
+
+private:
+	/// Character input, which keeps the furthest char read.
+	struct Input : public parser::CharInput {
+		Input(Source src, const Blanks& bl, ParseContext& ctx) : CharInput(src.beg, src.end, bl, ctx.scans, ctx.skips), reach(0) { }
+		void skip(Pos& p) const {
+			CharInput::skip(p);
+			// a comment may open at p: it is read up to its end
+			read(p, p != last && !blanks.delimiters().empty() && blanks.starts(*p) ? size_t(last - p) + 1 : 1);
+		}
+		uint peek(Pos p) const {
+			read(p, 1);
+			return CharInput::peek(p);
+		}
+		bool match(const parser::Node& n, Pos& p) const {
+			read(p, extent(n, p));
+			return CharInput::match(n, p);
+		}
+		void touch(size_t r) const { reach = std::max(reach, r); }
+		void read(Pos p, size_t n) const { touch(std::min(offset(p) + n, offset(last) + 1)); }
+		size_t extent(const parser::Node& n, Pos p) const {
+			if (n.scanner) return n.scanner->extent(p, last);
+			if (n.kind == Symb::KEYWORD) return static_cast<const symb::Keyword*>(n.symb)->body.size();
+			const Dfa& dfa = static_cast<const symb::Regexp*>(n.symb)->dfa;
+			return dfa.valid() ? dfa.extent(p, last) : last - p + 1;
+		}
+
+		mutable size_t reach;
+	};
+
+	/// A node with its reach. A node of the previous tree (old is its index) has no children.
+	struct Reached : public expr::Seq {
+		Reached(StrIter b, StrIter e, const Rule* r, ExprSpan v, ExprArena* a, size_t re, uint o) :
+			Seq(b, e, r, v, a), reach(re), old(o) { }
+		size_t reach;
+		uint   old;
+	};
+
+	/// The program, which builds Reached nodes.
+	struct Code {
+		const vm::Instr* instrs() const { return p.instrs(); }
+		uint entry(uint tree) const { return p.entry(tree); }
+		bool test(uint set, uint c) const { return p.test(set, c); }
+		uint jump(uint table, uint c) const { return p.jump(table, c); }
+		const void* key(uint tree) const { return p.key(tree); }
+		bool match(const Input& i, uint terminal, StrIter& pos) const { return p.match(i, terminal, pos); }
+		Expr* accept(ExprArena* arena, StrIter b, StrIter e, uint rule, ExprSpan kids) const {
+			return create<Reached>(arena, b, e, p.rules[rule], kids, arena, in.reach, uint(-1));
+		}
+		uint rule_id(uint rule) const { return p.rule_id(rule); }
+
+		const vm::Program& p;
+		const Input&       in;
+	};
+
+	bool run(Source src, const vector<Edit>& edits);
+	bool clean(const vector<Edit>& edits, uint node, ptrdiff_t& shift) const;
+	void seed(parser::Memo& memo, ExprArena& arena, StrIter origin, const vector<Edit>& edits) const;
+	void assemble(const Expr* root, StrIter origin);
+
+	const Parser&       parser;
+	uint                start;  // the non-terminal in the program
+	vector<const void*> keys;   // memo key of the non-terminal of each rule
+	FlatTree            flat;
+	vector<size_t>      reaches;
+	vector<ptrdiff_t>   shifts; // the change of the length by the edits before each one
+	size_t              length; // of the source of the tree
+	uint                copied;
+};
+
+IncrementalParser::IncrementalParser(const Parser& p, const string& type) : parser(p), start(0), keys(), flat(), reaches(), shifts(), length(0), copied(0) {
+	auto it = p.trees.find(type);
+	if (it == p.trees.end()) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
+	}
+	start = p.program.index.at(&it->second);
+	for (const Rule* r : p.grammar.rules) {
+		if (keys.size() <= r->id) keys.resize(r->id + 1, nullptr);
+		keys[r->id] = &p.trees.at(r->left->name);
+	}
+}
+
+bool IncrementalParser::parse(Source src) {
+	flat.nodes.clear();
+	return run(src, {});
+}
+
+bool IncrementalParser::reparse(Source src, const vector<Edit>& edits) {
+	shifts.assign(1, 0);
+	size_t prev = 0; // the end of the previous edit
+	for (const Edit& e : edits) {
+		if (e.offset < prev || e.offset + e.removed > length) {
+			std::cerr << "edit at " << e.offset << " is out of order or out of the source" << std::endl;
+			throw std::exception();
+		}
+		prev = e.offset + e.removed;
+		shifts.push_back(shifts.back() + ptrdiff_t(e.inserted.size()) - ptrdiff_t(e.removed));
+	}
+	if (size_t(src.end - src.beg) != length + shifts.back()) {
+		std::cerr << "the edits do not give a source of length " << (src.end - src.beg) << std::endl;
+		throw std::exception();
+	}
+	return run(src, edits);
+}
+
+string IncrementalParser::apply(const string& text, const vector<Edit>& edits) {
+	string ret;
+	size_t pos = 0;
+	for (const Edit& e : edits) {
+		ret.append(text, pos, e.offset - pos);
+		ret += e.inserted;
+		pos = e.offset + e.removed;
+	}
+	ret.append(text, pos, string::npos);
+	return ret;
+}
+
+/// The old tree is reused, unless it is empty.
+bool IncrementalParser::run(Source src, const vector<Edit>& edits) {
+	ParseContext& ctx = ParseContext::local();
+	ExprArena& arena = ctx.arena;
+	Input in(src, parser.blanks, ctx);
+	parser::Memo memo(0, &arena); // nothing is stored while parsing
+	if (!flat.empty()) seed(memo, arena, src.beg, edits);
+	StrIter pos = src.beg;
+	Expr* root = vm::run(Code{parser.program, in}, start, in, pos, parser::Context{&memo, &arena, nullptr, nullptr}, ctx.vm_chars);
+	if (root) in.skip(pos);
+	if (root && pos == src.end) {
+		assemble(root, src.beg);
+	} else {
+		flat.nodes.clear();
+		reaches.clear();
+		copied = 0;
+	}
+	length = src.end - src.beg;
+	arena.clear();
+	return !flat.empty();
+}
+
+/// No edit is between the beginning and the reach of a node, the ones before it shift it.
+bool IncrementalParser::clean(const vector<Edit>& edits, uint node, ptrdiff_t& shift) const {
+	size_t beg = flat[node].beg;
+	auto it = std::partition_point(edits.begin(), edits.end(), [beg](const Edit& e) { return e.offset + e.removed <= beg; });
+	shift = shifts[it - edits.begin()];
+	return it == edits.end() || it->offset >= reaches[node];
+}
+
+/// Puts the maximal clean nodes under the dirty ones into the memo, the root is parsed anyway.
+void IncrementalParser::seed(parser::Memo& memo, ExprArena& arena, StrIter origin, const vector<Edit>& edits) const {
+	vector<uint> dirty{0};
+	while (!dirty.empty()) {
+		const FlatTree::Node& d = flat[dirty.back()];
+		dirty.pop_back();
+		for (uint i = d.first; i < d.first + d.size; ++ i) {
+			const FlatTree::Node& n = flat[i];
+			ptrdiff_t shift;
+			if (n.lexeme()) continue;
+			if (!clean(edits, i, shift)) {
+				dirty.push_back(i);
+				continue;
+			}
+			const Rule* rule = parser.grammar.rules[n.rule];
+			Expr* ex = create<Reached>(&arena, origin + n.beg + shift, origin + n.end + shift, rule, ExprSpan(nullptr, 0), &arena, reaches[i] + shift, i);
+			memo.seed(keys[n.rule], n.beg + shift, n.end + shift, reaches[i] + shift, ex);
+		}
+	}
+}
+
+/// Flattens the new tree, a reused node brings its old subtree along.
+void IncrementalParser::assemble(const Expr* root, StrIter origin) {
+	struct Item {
+		const Expr* expr; // nullptr: a node of the old tree
+		uint        old;
+		ptrdiff_t   shift;
+	};
+	vector<Item> items{Item{root, 0, 0}};
+	vector<FlatTree::Node> nodes;
+	vector<size_t> re;
+	copied = 0;
+	for (size_t i = 0; i < items.size(); ++ i) {
+		Item it = items[i];
+		if (it.expr && it.expr->kind == Expr::OPERATOR && static_cast<const Reached*>(it.expr)->old != uint(-1)) {
+			uint old = static_cast<const Reached*>(it.expr)->old;
+			it = Item{nullptr, old, (it.expr->beg - origin) - ptrdiff_t(flat[old].beg)};
+		}
+		if (!it.expr) {
+			const FlatTree::Node& o = flat[it.old];
+			nodes.push_back(FlatTree::Node{o.rule, uint(o.beg + it.shift), uint(o.end + it.shift), uint(items.size()), o.size});
+			re.push_back(reaches[it.old] + it.shift);
+			for (uint c = o.first; c < o.first + o.size; ++ c) items.push_back(Item{nullptr, c, it.shift});
+			++ copied;
+			continue;
+		}
+		const Expr* ex = it.expr;
+		FlatTree::Node n{FlatTree::LEXEME, uint(ex->beg - origin), uint(ex->end - origin), uint(items.size()), 0};
+		size_t r = n.end;
+		if (ex->kind == Expr::OPERATOR) {
+			const Reached* op = static_cast<const Reached*>(ex);
+			n.rule = op->rule_id();
+			n.size = op->nodes.size();
+			r = op->reach;
+			for (const Expr* c : op->nodes) items.push_back(Item{c, 0, 0});
+		}
+		nodes.push_back(n);
+		re.push_back(r);
+	}
+	flat.nodes.swap(nodes);
+	reaches.swap(re);
+}
+
+}
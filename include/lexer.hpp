@@ -0,0 +1,73 @@
+#pragma once
+
+#include "grammar.hpp"
+
+namespace dynaparse {
+
+struct Token {
+	uint    id;  // id of the symbol
+	StrIter beg;
+	StrIter end;
+};
+
+/**
+ * Lexer built from the Keyword/Regexp symbols of a grammar.
+ * At each position the longest match wins; on equal length
+ * a keyword beats a regexp, an earlier declared symbol beats a later one.
+ * The empty keyword is not a token: it is matched by the parser as epsilon.
+ */
+struct Lexer {
+	Lexer(const Grammar& gr) : keywords(), regexps(), blanks(gr.skipper, gr.comments), epsilon(Symb::NO_ID) {
+		vector<bool> seen(gr.symb_ids.size(), false);
+		for (Symb* s : gr.symbs) {
+			if (seen[s->id]) continue; // a redeclaration
+			seen[s->id] = true;
+			switch (s->kind) {
+			case Symb::KEYWORD: {
+				const symb::Keyword* kw = static_cast<const symb::Keyword*>(s);
+				if (kw->body.empty()) epsilon = kw->id;
+				else keywords[static_cast<unsigned char>(kw->body[0])].push_back(kw);
+				break;
+			}
+			case Symb::REGEXP:
+				regexps.push_back(static_cast<const symb::Regexp*>(s));
+				break;
+			default: break;
+			}
+		}
+	}
+
+	bool tokenize(StrIter beg, StrIter end, vector<Token>& tokens) const {
+		tokens.clear();
+		StrIter ch = beg;
+		while (true) {
+			blanks.skip(ch, end);
+			if (ch == end) return true;
+			Token tok{Symb::NO_ID, ch, ch};
+			for (const symb::Keyword* kw : keywords[static_cast<unsigned char>(*ch)]) {
+				StrIter e = ch;
+				if (kw->matches(e, end) && e > tok.end) {
+					tok.id = kw->id;
+					tok.end = e;
+				}
+			}
+			for (const symb::Regexp* re : regexps) {
+				StrIter e = ch;
+				if (re->matches(e, end) && e > tok.end) {
+					tok.id = re->id;
+					tok.end = e;
+				}
+			}
+			if (tok.id == Symb::NO_ID) return false;
+			tokens.push_back(tok);
+			ch = tok.end;
+		}
+	}
+
+	vector<const symb::Keyword*> keywords[256]; // indexed by the first character
+	vector<const symb::Regexp*>  regexps;
+	Blanks                       blanks;
+	uint                         epsilon; // id of the empty keyword
+};
+
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "std.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace dynaparse {
+
+/**
+ * Read-only memory mapping of a whole file, so that it is parsed in place
+ * without loading it into a string. Parse trees point into the mapping,
+ * so the file must outlive them: keep it in a variable,
+ *
+ *     MappedFile file(path);
+ *     Expr* ex = parser.parse(file, type);
+ *
+ * a temporary MappedFile is not taken as a Source.
+ */
+class MappedFile {
+public:
+	MappedFile(const string& path) : ptr(nullptr), len(0) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || ::fstat(fd, &st) < 0) {
+			if (fd >= 0) ::close(fd);
+			std::cerr << "can't open file " << path << std::endl;
+			throw std::exception();
+		}
+		len = st.st_size;
+		if (len) {
+			void* p = ::mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (p == MAP_FAILED) {
+				::close(fd);
+				std::cerr << "can't map file " << path << std::endl;
+				throw std::exception();
+			}
+			ptr = static_cast<const char*>(p);
+			::madvise(p, len, MADV_SEQUENTIAL);
+		}
+		::close(fd);
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator = (const MappedFile&) = delete;
+	~ MappedFile() {
+		if (ptr) ::munmap(const_cast<char*>(ptr), len);
+	}
+
+	const char* data() const { return ptr; }
+	size_t size() const { return len; }
+
+private:
+	const char* ptr;
+	size_t      len;
+};
+
+}
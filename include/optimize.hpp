@@ -0,0 +1,311 @@
+#pragma once
+
+#include "analysis.hpp"
+
+#include <unordered_map>
+
+namespace dynaparse {
+
+/// What optimize() changed.
+struct Optimization {
+	uint unproductive; // rules removed: they derive no string
+	uint unreachable;  // rules removed: their non-terminals are not reachable from the starts
+	uint collapsed;    // unit rules M -> N, replaced by the rules of N
+	uint inlined;      // non-terminals with one rule, inlined where they are used
+	uint rules[2];     // number of rules before and after
+	uint symbols[2];   // number of symbols in the right sides before and after
+	vector<string> log;
+
+	string show() const {
+		string ret;
+		for (const string& s : log) ret += s + "\n";
+		ret += "rules: " + std::to_string(rules[0]) + " -> " + std::to_string(rules[1]) + ", ";
+		ret += "symbols: " + std::to_string(symbols[0]) + " -> " + std::to_string(symbols[1]) + "\n";
+		return ret;
+	}
+};
+
+namespace opt {
+
+inline vector<Syntagma*>& right(Rule* r) { return static_cast<rule::Seq*>(r->right)->operands; }
+inline const Symb* symb(const Syntagma* s) { return static_cast<const rule::Ref*>(s)->ref; }
+inline uint left(const Rule* r) { return r->left->ref->id; }
+
+/// Restores the links of the operands of a rule after they were changed.
+inline void relink(Rule* r) {
+	vector<Syntagma*>& ops = right(r);
+	for (uint i = 0; i < ops.size(); ++ i) {
+		ops[i]->parent = static_cast<rule::Operator*>(r->right);
+		ops[i]->place = i;
+		ops[i]->rule = r;
+	}
+}
+
+/**
+ * The passes over a flattened grammar. Rules, which go away, are marked dead
+ * and deleted at the end at once.
+ */
+struct Passes {
+	Grammar&         gr;
+	std::set<uint>   starts;
+	vector<bool>     dead;
+	Optimization&    report;
+
+	bool nonterm(const Syntagma* s) const { return symb(s)->kind == Symb::NONTERM; }
+
+	vector<vector<Rule*>> by_left() const {
+		vector<vector<Rule*>> ret(gr.symb_ids.size());
+		for (Rule* r : gr.rules) if (!dead[r->id]) ret[left(r)].push_back(r);
+		return ret;
+	}
+
+	void kill(Rule* r, uint& counter, const string& why) {
+		dead[r->id] = true;
+		++ counter;
+		report.log.push_back("removed " + why + " " + r->show());
+	}
+
+	/// Removes the rules with a symbol, which derives no string (a non-terminal without productive rules).
+	void unproductive() {
+		vector<bool> productive(gr.symb_ids.size(), false);
+		for (const Symb* s : gr.symbs) if (s->kind != Symb::NONTERM) productive[s->id] = true;
+		vector<uint> missing(gr.rules.size(), 0); // non-productive symbols of a rule, counted with repetitions
+		vector<vector<Rule*>> users(gr.symb_ids.size());
+		vector<uint> work;
+		for (Rule* r : gr.rules) {
+			for (Syntagma* s : right(r)) {
+				if (!productive[symb(s)->id]) {
+					++ missing[r->id];
+					users[symb(s)->id].push_back(r);
+				}
+			}
+			if (!missing[r->id] && !productive[left(r)]) {
+				productive[left(r)] = true;
+				work.push_back(left(r));
+			}
+		}
+		while (!work.empty()) {
+			uint x = work.back();
+			work.pop_back();
+			for (Rule* r : users[x]) {
+				if (-- missing[r->id] || productive[left(r)]) continue;
+				productive[left(r)] = true;
+				work.push_back(left(r));
+			}
+		}
+		for (Rule* r : gr.rules) if (missing[r->id] && !dead[r->id]) kill(r, report.unproductive, "unproductive");
+	}
+
+	/// Removes the rules of the non-terminals, which can't be reached from the starts.
+	void unreachable() {
+		vector<vector<Rule*>> rules = by_left();
+		vector<bool> seen(gr.symb_ids.size(), false);
+		vector<uint> work(starts.begin(), starts.end());
+		for (uint s : work) seen[s] = true;
+		while (!work.empty()) {
+			uint x = work.back();
+			work.pop_back();
+			for (Rule* r : rules[x]) {
+				for (Syntagma* s : right(r)) {
+					uint y = symb(s)->id;
+					if (!seen[y]) {
+						seen[y] = true;
+						work.push_back(y);
+					}
+				}
+			}
+		}
+		for (Rule* r : gr.rules) if (!dead[r->id] && !seen[left(r)]) kill(r, report.unreachable, "unreachable");
+	}
+
+	/**
+	 * M -> N, the only rule of M, where N is used nowhere else: M takes the rules
+	 * of N in their order and N is renamed to M in them. The trie of M becomes
+	 * the one of N, one call less.
+	 */
+	bool collapse() {
+		bool changed = false;
+		vector<vector<Rule*>> rules = by_left();
+		vector<uint> uses = count_uses();
+		for (uint m = 0; m < rules.size(); ++ m) {
+			if (rules[m].size() != 1 || right(rules[m][0]).size() != 1) continue;
+			Rule* unit = rules[m][0];
+			const Syntagma* ref = right(unit)[0];
+			uint n = symb(ref)->id;
+			if (!nonterm(ref) || n == m || uses[n] != 1 || starts.count(n) || rules[n].empty()) continue;
+			Symb* to = unit->left->ref;
+			report.log.push_back("collapsed " + unit->show() + " into the rules of " + symb(ref)->name);
+			for (Rule* r : rules[n]) {
+				r->left->ref = to;
+				r->left->name = to->name;
+				for (Syntagma*& s : right(r)) {
+					if (symb(s)->id == n) static_cast<rule::Ref*>(s)->ref = to;
+				}
+			}
+			dead[unit->id] = true;
+			rules[m] = rules[n];
+			rules[n].clear();
+			++ report.collapsed;
+			changed = true;
+		}
+		return changed;
+	}
+
+	/// Occurrences of the symbols on the right sides, except in the rules of the symbols themselves.
+	vector<uint> count_uses() const {
+		vector<uint> uses(gr.symb_ids.size(), 0);
+		for (Rule* r : gr.rules) {
+			if (dead[r->id]) continue;
+			for (Syntagma* s : right(r)) if (symb(s)->id != left(r)) ++ uses[symb(s)->id];
+		}
+		return uses;
+	}
+
+	static uint64_t step(uint64_t h, uint id) { return (h + id + 1) * 0x9e3779b97f4a7c15ull; }
+
+	/**
+	 * N -> beta, the only rule of N, used once or with one symbol on the right:
+	 * N is replaced by beta where it is used. In a trie the node of N turns into
+	 * the path of beta, which must not merge into a sibling: the order, in which
+	 * the alternatives are tried, would change then. So a use is inlined only,
+	 * if no other rule of the same non-terminal continues its prefix with a symbol,
+	 * which clashes with the first one of beta. A non-terminal is inlined at all
+	 * its uses or nowhere. The prefixes are those at the beginning of a round,
+	 * so a non-terminal, whose rules were changed, is left to the next one.
+	 */
+	bool inline_rules() {
+		vector<vector<Rule*>> rules = by_left();
+		vector<uint> uses = count_uses();
+		Analysis an(gr);
+		vector<bool> left_recursive(gr.symb_ids.size(), false);
+		vector<vector<pair<Rule*, uint>>> sites(gr.symb_ids.size());
+		std::unordered_map<uint64_t, vector<uint>> next; // hash of the left side and of a prefix of a right side: the symbols after it
+		for (Rule* r : gr.rules) {
+			if (dead[r->id]) continue;
+			const vector<Syntagma*>& ops = right(r);
+			if (symb(ops[0])->id == left(r)) left_recursive[left(r)] = true;
+			uint64_t h = step(0, left(r));
+			for (uint i = 0; i < ops.size(); ++ i) {
+				if (nonterm(ops[i])) sites[symb(ops[i])->id].emplace_back(r, i);
+				next[h].push_back(symb(ops[i])->id);
+				h = step(h, symb(ops[i])->id);
+			}
+		}
+		vector<bool> nonterms(gr.symb_ids.size(), false);
+		for (const Symb* s : gr.symbs) nonterms[s->id] = s->kind == Symb::NONTERM;
+		// the same symbol, or a non-terminal, which may start like the other one: it may be inlined later
+		auto clash = [&an, &nonterms](uint x, uint y) {
+			return x == y || ((nonterms[x] || nonterms[y]) && (an.first[x] & an.first[y]).any());
+		};
+		vector<bool> touched(gr.symb_ids.size(), false); // rules of the non-terminal changed in this round
+		bool changed = false;
+		for (uint n = 0; n < rules.size(); ++ n) {
+			if (rules[n].size() != 1 || starts.count(n) || !uses[n]) continue;
+			Rule* def = rules[n][0];
+			const vector<Syntagma*>& beta = right(def);
+			if (uses[n] != 1 && beta.size() != 1) continue;
+			bool ok = !touched[n];
+			for (Syntagma* s : beta) ok &= symb(s)->id != n;
+			const Symb* first = symb(beta[0]);
+			for (auto& site : sites[n]) {
+				Rule* r = site.first;
+				if (!ok) break;
+				if (r == def || touched[left(r)]) ok = false;
+				else if (site.second == 0 && first->kind == Symb::NONTERM && (first->id == left(r) || left_recursive[first->id])) ok = false;
+				else {
+					uint64_t h = step(0, left(r));
+					for (uint i = 0; i < site.second; ++ i) h = step(h, symb(right(r)[i])->id);
+					for (uint y : next[h]) ok &= y == n || !clash(y, first->id);
+				}
+			}
+			if (!ok) continue;
+			report.log.push_back("inlined " + def->show() + " into " + std::to_string(sites[n].size()) + " rule(s)");
+			// the sites of one rule are replaced from the back, so that the positions stay valid
+			for (auto it = sites[n].rbegin(); it != sites[n].rend(); ++ it) {
+				vector<Syntagma*>& ops = right(it->first);
+				vector<Syntagma*> copy;
+				for (Syntagma* s : beta) copy.push_back(new rule::Ref(static_cast<rule::Ref*>(s)->ref));
+				delete ops[it->second];
+				ops.erase(ops.begin() + it->second);
+				ops.insert(ops.begin() + it->second, copy.begin(), copy.end());
+				relink(it->first);
+				touched[left(it->first)] = true;
+			}
+			dead[def->id] = true;
+			touched[n] = true;
+			++ report.inlined;
+			changed = true;
+		}
+		return changed;
+	}
+
+	/// Deletes the dead rules, the others are renumbered.
+	void sweep() {
+		vector<Rule*> alive;
+		for (Rule* r : gr.rules) {
+			if (dead[r->id]) delete r;
+			else {
+				r->id = alive.size();
+				alive.push_back(r);
+			}
+		}
+		gr.rules.swap(alive);
+		gr.flat = gr.rules.size();
+		dead.assign(gr.rules.size(), false);
+	}
+
+	static uint size(const Grammar& gr) {
+		uint ret = 0;
+		for (Rule* r : gr.rules) ret += right(r).size();
+		return ret;
+	}
+};
+
+}
+
+/**
+ * Simplifies a flattened grammar, so that the tries get fewer levels and
+ * a parse makes fewer calls. Non-terminals in starts are kept as they are,
+ * the others may disappear:
+ *  - rules, which derive no string, and rules of non-terminals not reachable
+ *    from the starts are removed;
+ *  - unit rules M -> N are collapsed, if N is used only there;
+ *  - non-terminals with one rule, which are used once or have one symbol
+ *    on the right side, are inlined.
+ * The parses of the start symbols succeed on the same inputs and end at the
+ * same positions. The trees lose the nodes of the removed non-terminals: their
+ * children move to the parents. Common prefixes of rules are shared by the
+ * tries anyway, so left factoring is left to them.
+ */
+inline Optimization optimize(Grammar& gr, const vector<string>& starts) {
+	if (gr.flat < gr.rules.size()) {
+		std::cerr << "grammar must be flattened before optimization" << std::endl;
+		throw std::exception();
+	}
+	Optimization report{0, 0, 0, 0, {uint(gr.rules.size()), 0}, {opt::Passes::size(gr), 0}, {}};
+	opt::Passes p{gr, {}, vector<bool>(gr.rules.size(), false), report};
+	for (const string& s : starts) {
+		auto it = gr.symb_map.find(s);
+		if (it == gr.symb_map.end() || it->second->kind != Symb::NONTERM) {
+			std::cerr << "undefined symbol: " << s << std::endl;
+			throw std::exception();
+		}
+		p.starts.insert(it->second->id);
+	}
+	p.unproductive();
+	p.unreachable();
+	p.sweep();
+	while (true) {
+		bool changed = p.collapse();
+		p.sweep();
+		changed |= p.inline_rules();
+		p.sweep();
+		if (!changed) break;
+	}
+	gr.changed();
+	report.rules[1] = gr.rules.size();
+	report.symbols[1] = opt::Passes::size(gr);
+	return report;
+}
+
+}
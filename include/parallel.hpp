@@ -0,0 +1,92 @@
+#pragma once
+
+#include "parser.hpp"
+
+namespace dynaparse {
+
+/// A point, where a parse may be split: the non-terminal element is expected after the token.
+struct Sync {
+	string token;
+	string element;
+};
+
+/**
+ * Parses one large source on several threads. The source is cut into equal
+ * parts, and in each of them the elements of the syncs are parsed at once,
+ * starting after every occurrence of their tokens (the elements, which a
+ * parse of the part covers, are not tried again). The guesses go into
+ * the packrat memo, then the bytecode parses the source: it takes a guessed
+ * subtree, where it calls the element at the same position, and parses
+ * itself everywhere else. A non-terminal parses the same wherever it is
+ * called, so a guess is either exactly the subtree of the serial parse
+ * or never asked for: wrong splits (a token in a comment or nested deeper
+ * than the element) only cost the work of the guess.
+ *
+ * Typical syncs are a separator and the element of an iteration, which
+ * flaten_ebnf turned into a chain: {";", "ProcDecl"} for the declarations
+ * of an Oberon module. The serial pass walks the chain, its cost is the number
+ * of the elements.
+ */
+inline bool parse_parallel(const Parser& p, Source src, const string& type, const vector<Sync>& syncs, FlatTree& out, uint threads = 0) {
+	struct Guess {
+		uint   tree;  // the element in the program
+		size_t beg;
+		size_t end;
+		Expr*  expr;  // nullptr: the element fails there
+	};
+	vector<uint> elements;
+	for (const Sync& s : syncs) {
+		auto it = p.trees.find(s.element);
+		if (it == p.trees.end() || s.token.empty()) {
+			std::cerr << "wrong sync: " << s.token << " " << s.element << std::endl;
+			throw std::exception();
+		}
+		elements.push_back(p.program.index.at(&it->second));
+	}
+	auto start = p.trees.find(type);
+	if (start == p.trees.end()) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
+	}
+	WorkPool& pool = p.pool(threads);
+	size_t len = src.end - src.beg;
+	size_t parts = std::max<size_t>(1, std::min<size_t>(pool.workers * 4, len / 4096));
+	vector<vector<Guess>> guesses(parts);
+	vector<std::unique_ptr<ExprArena>> arenas(parts);
+	pool.run(parts, [&](size_t i) {
+		ParseContext& ctx = ParseContext::local();
+		parser::CharInput in(src.beg, src.end, p.blanks, ctx.scans, ctx.skips);
+		arenas[i].reset(new ExprArena());
+		ExprArena& arena = *arenas[i];
+		StrIter b = src.beg + len * i / parts, e = src.beg + len * (i + 1) / parts;
+		for (uint s = 0; s < syncs.size(); ++ s) {
+			const string& token = syncs[s].token;
+			StrIter covered = b; // the end of the last element parsed
+			for (StrIter t = std::search(b, e, token.begin(), token.end()); t != e; t = std::search(t + 1, e, token.begin(), token.end())) {
+				StrIter pos = t + token.size();
+				in.skip(pos);
+				if (pos < covered) continue;
+				ExprArena::Mark mark = arena.mark();
+				size_t beg = pos - src.beg;
+				Expr* ex = vm::run(p.program, elements[s], in, pos, parser::Context{nullptr, &arena, nullptr, nullptr}, ctx.vm_chars);
+				if (!ex) arena.rollback(mark);
+				guesses[i].push_back(Guess{elements[s], ex ? size_t(ex->beg - src.beg) : beg, ex ? size_t(ex->end - src.beg) : beg, ex});
+				if (ex) covered = ex->end;
+			}
+		}
+	});
+	ParseContext& ctx = ParseContext::local();
+	parser::Memo memo(0, &ctx.arena); // keeps the guesses only
+	for (const vector<Guess>& gs : guesses) {
+		for (const Guess& g : gs) memo.seed(p.program.key(g.tree), g.beg, g.end, g.end, g.expr);
+	}
+	parser::CharInput in(src.beg, src.end, p.blanks, ctx.scans, ctx.skips);
+	StrIter pos = src.beg;
+	Expr* root = vm::run(p.program, p.program.index.at(&start->second), in, pos, parser::Context{&memo, &ctx.arena, nullptr, nullptr}, ctx.vm_chars);
+	if (root) in.skip(pos);
+	out.assign(root && pos == src.end ? root : nullptr, src.beg);
+	ctx.arena.clear();
+	return !out.empty();
+}
+
+}
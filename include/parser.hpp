@@ -1,232 +1,347 @@
 #pragma once
 
-#include "syntagma.hpp"
-#include "expr.hpp"
+#include "trie.hpp"
+#include "vm.hpp"
+#include "flat.hpp"
+#include "mapped.hpp"
+#include "pool.hpp"
 
 namespace dynaparse {
-namespace parser {
 
-struct Node;
+/**
+ * Memory, which parses reuse: the stacks of the engine, the scanner cache,
+ * the token buffer, the nodes and the arena for flat trees. Once a context
+ * is warm, parsing allocates only the parse trees (and the packrat memo).
+ * A context serves one parse at a time, Parser takes the one of its thread.
+ */
+struct ParseContext {
+	parser::Stacks<StrIter>         chars;
+	parser::Stacks<const Token*>    tokens;
+	vm::Stack<StrIter>              vm_chars;
+	vm::Stack<const Token*>         vm_tokens;
+	vector<parser::CharInput::Scan> scans;
+	vector<parser::CharInput::Skip> skips;
+	vector<Token>                   lexemes;
+	vector<Event>                   events;
+	FlatTree::Builder               flat;
+	ExprArena                       arena;
 
-typedef vector<Node> Tree;
-
-struct Node {
-	bool   final;
-	Tree   next;
-	const Symb* symb;
-	const Tree* tree;
-	const Rule* rule;
+	static ParseContext& local() {
+		static thread_local ParseContext ctx;
+		return ctx;
+	}
 };
 
-vector<string> show_vect(const Node& n);
+/**
+ * A source to parse: any contiguous character range, which outlives
+ * the parse trees, since they point into it. Strings, vectors of chars
+ * and mapped files (see MappedFile) convert implicitly, temporaries don't:
+ * they would be gone before the tree is read.
+ */
+struct Source {
+	Source(StrIter b, StrIter e) : beg(b), end(e) { }
+	/// A literal 0 would be a null end: a range of a length is made by of().
+	Source(StrIter b, int len) = delete;
+	/// The len chars at b.
+	static Source of(StrIter b, size_t len) { return Source(b, b + len); }
+	template<class Chars>
+	Source(const Chars& cs) : beg(cs.data()), end(cs.data() + cs.size()) { }
+	template<class Chars>
+	Source(const Chars&&) = delete;
+	StrIter beg;
+	StrIter end;
+};
 
-vector<string> show_vect(const Tree& t) {
-	vector<string> ret;
-	for (const Node& n : t) {
-		vector<string> v = show_vect(n);
-		for (string& s : v) ret.push_back(s);
+class Parser {
+public :
+	Parser(Grammar& gr) : grammar(gr), trees(), lexer(gr), blanks(gr.skipper, gr.comments), analysis(gr), memo_limit(64 << 20), engine(BYTECODE), program(), derived(), symbs_seen(0), pools_mutex(), pools() {
+		declare_symbs();
+		for (Rule* rule : grammar.rules) {
+			add(trees, trees[rule->left->name], parser::path(rule))->rule = rule;
+		}
+		for (auto& p : trees) compile_scanners(p.second);
+		for (auto& p : trees) compile_lookahead(p.second, analysis);
+		for (auto& p : trees) complete_scanners(p.second);
+		vm::compile(program, trees);
 	}
-	return ret;
-}
+	/**
+	 * Adds a rule to the grammar and splices its flattened form into the tries,
+	 * the other ones are not rebuilt. Returns the added rule. Must not run
+	 * concurrently with parsing.
+	 */
+	const Rule* add_rule(Rule&& rule);
+	/**
+	 * Removes a rule (and the rules it was flattened into by add_rule) from
+	 * the grammar and the tries. Those rules can't be removed by themselves.
+	 */
+	void remove_rule(const Rule* rule);
 
-vector<string> show_vect(const Node& n) {
-	vector<string> ret;
-	vector<string> next = show_vect(n.next);
-	if (next.size()) {
-		for (string& s : next) {
-			ret.push_back(n.symb->name + (n.rule ? "[" + n.rule->show() + "]" : "") + " " + s);
-		}
-	} else {
-		ret.push_back(n.symb->name + (n.rule ? "[" + n.rule->show() + "]" : ""));
+	Expr* parse(Source src, const string& type, bool packrat = false) const {
+		return parse(src, type, nullptr, packrat);
+	}
+	Expr* parse_tokens(Source src, const string& type, bool packrat = false) const {
+		return parse_tokens(src, type, nullptr, packrat);
+	}
+	/// The result is allocated in the arena and lives until the arena is cleared.
+	Expr* parse(Source src, const string& type, ExprArena& arena, bool packrat = false) const {
+		return parse(src, type, &arena, packrat);
+	}
+	Expr* parse_tokens(Source src, const string& type, ExprArena& arena, bool packrat = false) const {
+		return parse_tokens(src, type, &arena, packrat);
+	}
+	/**
+	 * Parses into a compact tree, returns false when the source is not parsed.
+	 * The bytecode without packrat memo builds the nodes as it goes (see
+	 * FlatTree::Builder), otherwise the expressions are parsed into an arena
+	 * and flattened.
+	 */
+	bool parse(Source src, const string& type, FlatTree& out, bool packrat = false) const;
+	/**
+	 * Parses into events, which the handler gets while parsing goes on, no tree
+	 * is built. Runs the bytecode whatever the engine, without packrat memo.
+	 * The events of a failed parse may have been delivered in part.
+	 */
+	bool parse(Source src, const string& type, Handler& handler) const;
+	/**
+	 * Parses a batch of sources on a work-stealing pool, results are in the order
+	 * of the sources. A parser is never changed by parsing, so any number
+	 * of threads may use it at once. The pool (see pool) lives as long as
+	 * the parser, batches with the same number of threads take turns on it.
+	 */
+	vector<Expr*> parse_many(const vector<Source>& srcs, const string& type, uint threads = 0, bool packrat = false) const {
+		vector<Expr*> ret(srcs.size(), nullptr);
+		const parser::Tree& t = tree(type);
+		pool(threads).run(srcs.size(), [&](size_t i) {
+			ParseContext& ctx = ParseContext::local();
+			parser::CharInput in(srcs[i].beg, srcs[i].end, blanks, ctx.scans, ctx.skips);
+			ret[i] = parse(in, srcs[i].beg, t, nullptr, packrat, ctx.chars, ctx.vm_chars);
+		});
+		return ret;
 	}
-	return ret;
-}
 
-string show(const Node& n) {
-	string ret;
-	vector<string> vect = show_vect(n);
-	for (string& s : vect) {
-		ret += "\t" + s + "\n";
+	Grammar& grammar;
+	map<string, parser::Tree> trees;
+	Lexer    lexer;
+	Blanks   blanks;   // the skipper and the comments of the grammar, as it was constructed
+	Analysis analysis;
+	size_t   memo_limit; // upper bound for the packrat memo table in bytes
+	/// Parsing runs the bytecode of the tries, or walks the tries themselves.
+	enum Engine { BYTECODE, TRIES };
+	Engine       engine;
+	vm::Program  program;
+
+	/// The pool of that many threads (0: as many as cores), it is kept for the next batches.
+	WorkPool& pool(uint threads) const {
+		std::lock_guard<std::mutex> lock(pools_mutex);
+		std::unique_ptr<WorkPool>& p = pools[threads];
+		if (!p) p.reset(new WorkPool(threads));
+		return *p;
 	}
-	return ret;
-}
 
-string show(const Tree& tree) {
+private:
+	void declare_symbs();
+	void splice(Rule* rule, std::set<parser::Tree*>& changed);
+	void update(std::set<parser::Tree*>& changed, const vector<uint>& symbs);
+
+	map<const Rule*, vector<Rule*>> derived; // rules added by add_rule to the rules flattening gave
+	size_t symbs_seen; // grammar symbols already known to the tries and the lexer
+	mutable std::mutex pools_mutex;
+	mutable map<uint, std::unique_ptr<WorkPool>> pools; // by the number of threads asked for
+
+	Expr* parse(Source src, const string& type, ExprArena* arena, bool packrat) const;
+	Expr* parse_tokens(Source src, const string& type, ExprArena* arena, bool packrat) const;
+	template<class Input>
+	Expr* parse(const Input& in, typename Input::Pos beg, const parser::Tree& tree, ExprArena* arena, bool packrat,
+		parser::Stacks<typename Input::Pos>& stacks, vm::Stack<typename Input::Pos>& vm_stack) const;
+	const parser::Tree& tree(const string& type) const;
+};
+
+string show(const Parser& parser) {
 	string ret;
-	for (const Node& n : tree) {
-		ret += show(n);
+	for (auto& p : parser.trees) {
+		if (p.second.size()) {
+			ret += "tree for " + p.first + ":\n";
+			ret += show(p.second) + "\n";
+		}
 	}
 	return ret;
 }
 
-inline Node createNode(map<string, Tree>& trees, const Symb* s) {
-	Node n;
-	n.symb = s;
-	n.rule = nullptr;
-	n.tree = nullptr;
-	if (const symb::Nonterm* nt = dynamic_cast<const symb::Nonterm*>(s)) {
-		assert(nt && "must be non-terminal");
-		assert(trees.count(nt->name) && "non-terminal is not declared");
-		n.tree = &trees.at(nt->name);
-	}
-	return n;
+template<class Input>
+Expr* Parser::parse(const Input& in, typename Input::Pos beg, const parser::Tree& tree, ExprArena* arena, bool packrat,
+		parser::Stacks<typename Input::Pos>& stacks, vm::Stack<typename Input::Pos>& vm_stack) const {
+	parser::Memo memo(memo_limit, arena);
+	ExprArena::Mark mark = arena ? arena->mark() : ExprArena::Mark{0, 0};
+	parser::Context ctx{packrat ? &memo : nullptr, arena, nullptr, nullptr};
+	Expr* expr = engine == BYTECODE ?
+		vm::run(program, program.index.at(&tree), in, beg, ctx, vm_stack) :
+		parse_LL(in, beg, tree, ctx, stacks);
+	if (expr) {
+		in.skip(beg);
+		if (beg == in.last) return expr;
+		if (!arena) release(expr);
+	}
+	if (arena) arena->rollback(mark);
+	return nullptr;
 }
 
-inline Node* add(map<string, Tree>& trees, Tree& tree, const vector<Syntagma*>& ex) {
-	assert(ex.size());
-	Tree* m = &tree;
-	Node* n = nullptr;
-	for (Syntagma* ss : ex) {
-		rule::Ref* r = dynamic_cast<rule::Ref*>(ss);
-		if (!r) {
-			std::cerr << "syntagma " << ss->show() << " must be a symbol reference" <<std::endl;
-			throw std::exception();
-		}
-		bool new_symb = true;
-		for (Node& p : *m) {
-			if (p.symb->equals(r->ref)) {
-				n = &p;
-				m = &p.next;
-				new_symb = false;
-				break;
-			}
-		}
-		if (new_symb) {
-			if (m->size()) m->back().final = false;
-			m->push_back(createNode(trees, r->ref));
-			n = &m->back();
-			n->final = true;
-			m = &n->next;
+/// Creates the tries of new non-terminals, completes new regexps and updates the lexer.
+void Parser::declare_symbs() {
+	bool lexemes = false;
+	bool built = symbs_seen; // the constructor has built the lexer already
+	for (; symbs_seen < grammar.symbs.size(); ++ symbs_seen) {
+		Symb* s = grammar.symbs[symbs_seen];
+		switch (s->kind) {
+		case Symb::NONTERM:
+			trees[s->name];
+			break;
+		case Symb::REGEXP:
+			static_cast<const symb::Regexp*>(s)->dfa.complete();
+			lexemes = true;
+			break;
+		default:
+			lexemes = true;
 		}
 	}
-	return n;
+	if (lexemes && built) lexer = Lexer(grammar);
 }
 
-typedef Tree::const_iterator MapIter;
+/// Adds a rule to the trie of its non-terminal, the levels which got a node are recompiled at once.
+void Parser::splice(Rule* rule, std::set<parser::Tree*>& changed) {
+	parser::Tree& tree = trees[rule->left->name];
+	vector<parser::Tree*> grown;
+	add(trees, tree, parser::path(rule), &grown)->rule = rule;
+	for (parser::Tree* level : grown) {
+		compile_scanner(*level);
+		if (level->scanner) level->scanner->complete();
+	}
+	changed.insert(&tree);
+}
 
-enum class Action { RET, BREAK, CONT };
+/**
+ * Recomputes the lookahead and the code of the changed tries and of those,
+ * which refer to a symbol with changed sets or to a changed non-terminal.
+ */
+void Parser::update(std::set<parser::Tree*>& changed, const vector<uint>& symbs) {
+	for (uint s : symbs) {
+		for (const Rule* r : analysis.users[s]) changed.insert(&trees[r->left->name]);
+	}
+	for (parser::Tree* t : changed) compile_lookahead(*t, analysis);
+	vm::update(program, trees, vm::Trees(changed.begin(), changed.end()));
+}
 
-inline Action act(stack<MapIter>& n, stack<StrIter>& m, StrIter beg, StrIter ch, StrIter end, const Rule*& rule) {
-	if (const Rule* r = n.top()->rule) {
-		rule = r;
-		return Action::RET;
-	} /*else if (ch == end)
-		return Action::BREAK;*/
-	else {
-		n.push(n.top()->next.begin());
-		m.push(ch);
+const Rule* Parser::add_rule(Rule&& r) {
+	size_t n = grammar.rules.size();
+	grammar << std::move(r);
+	grammar.flaten_ebnf();
+	declare_symbs();
+	std::set<parser::Tree*> changed;
+	vector<uint> symbs = analysis.add(grammar, n);
+	for (size_t i = n; i < grammar.rules.size(); ++ i) {
+		// the callers of an empty trie fail at once, the first node of another one stays
+		const Rule* r = grammar.rules[i];
+		if (trees[r->left->name].empty()) symbs.push_back(r->left->ref->id);
+		splice(grammar.rules[i], changed);
 	}
-	return Action::CONT;
+	derived[grammar.rules[n]].assign(grammar.rules.begin() + n, grammar.rules.end());
+	update(changed, symbs);
+	return grammar.rules[n];
 }
 
-inline Expr* parse_LL(StrIter& beg, StrIter end, Skipper* skipper, const Tree& tree, bool initial = false) {
-	if (initial || !tree.size()) {
-		return nullptr;
-	}
-	skip(skipper, beg, end);
-
-	vector<Expr*> children;
-	const Rule* rule = nullptr;
-
-	stack<MapIter> n;
-	stack<StrIter> m;
-	stack<MapIter> childnodes;
-	n.push(tree.begin());
-	m.push(beg);
-	StrIter b = beg;
-	StrIter ch = beg;
-	while (!n.empty() && !m.empty()) {
-		ch = m.top();
-		skip(skipper, ch, end);
-		StrIter c = ch;
-		const Node& node = *n.top();
-
-		//cout << "node: \n" << show(node) << endl;
-
-		if (const Tree* deeper = node.tree) {
-			//cout << "deeper: \n" << show(*deeper) << endl;
-			childnodes.push(n.top());
-			if (Expr* child = parse_LL(ch, end, skipper, *deeper, (n.top() == tree.begin()) && (deeper == deeper->begin()->tree))) {
-				children.push_back(child);
-				switch (act(n, m, beg, ch, end, rule)) {
-				case Action::RET  : beg = ch; return new expr::Seq(b, ch, rule, children);
-				case Action::BREAK: return nullptr;
-				case Action::CONT : continue;
-				}
-			} else {
-				childnodes.pop();
-			}
-		} else if (node.symb->matches(ch, end)) {
-			children.push_back(new expr::Lexeme(c, ch));
-			switch (act(n, m, beg, ch, end, rule)) {
-			case Action::RET  : beg = ch; return new expr::Seq(b, ch, rule, children);
-			case Action::BREAK: return nullptr;
-			case Action::CONT : continue;
-			}
+/**
+ * Removing may shrink the sets of the analysis, so unlike adding it makes
+ * the analysis anew: the cost grows with the grammar.
+ */
+void Parser::remove_rule(const Rule* rule) {
+	if (rule->id >= grammar.rules.size() || grammar.rules[rule->id] != rule) {
+		std::cerr << "rule " << rule->show() << " is not in the grammar" << std::endl;
+		throw std::exception();
+	}
+	for (auto& d : derived) {
+		if (d.first != rule && std::count(d.second.begin(), d.second.end(), rule)) {
+			std::cerr << "rule " << rule->show() << " is a part of " << d.first->show() << ", remove that one" << std::endl;
+			throw std::exception();
 		}
-		while (n.top()->final) {
-			n.pop();
-			m.pop();
-			if (!childnodes.empty() && childnodes.top() == n.top()) {
-				delete children.back();
-				children.pop_back();
-				childnodes.pop();
-			}
-			if (n.empty() || m.empty()) return nullptr;
+	}
+	auto d = derived.find(rule);
+	vector<Rule*> rules = d == derived.end() ? vector<Rule*>{grammar.rules[rule->id]} : d->second;
+	if (d != derived.end()) derived.erase(d);
+	std::set<parser::Tree*> changed;
+	vector<uint> symbs;
+	for (Rule* r : rules) {
+		symbs.push_back(r->left->ref->id);
+		parser::Tree& tree = trees[r->left->name];
+		if (parser::Tree* level = remove(tree, r, parser::path(r))) {
+			compile_scanner(*level);
+			if (level->scanner) level->scanner->complete();
 		}
-		++n.top();
+		changed.insert(&tree);
+		grammar.remove(r);
 	}
-	return nullptr;
+	Analysis an(grammar);
+	for (uint i = 0; i < an.first.size(); ++ i) {
+		if (i >= analysis.first.size() || an.first[i] != analysis.first[i] || an.nullable[i] != analysis.nullable[i]) symbs.push_back(i);
+	}
+	analysis = std::move(an);
+	update(changed, symbs);
 }
 
-} // parser namespace
-
-class Parser {
-public :
-	Parser(Grammar& gr) : grammar(gr), trees() {
-		for (Symb* s : grammar.symbs) {
-			if (symb::Nonterm* nt = dynamic_cast<symb::Nonterm*>(s)) {
-				trees[nt->name];
-			}
-		}
-		for (Rule* rule : grammar.rules) {
-			rule::Ref* nt = dynamic_cast<rule::Ref*>(rule->left);
-			parser::Tree& tree = trees[nt->name];
-			parser::Node* n = nullptr;
-			if (rule::NaryOperator* op = dynamic_cast<rule::NaryOperator*>(rule->right)) {
-				n = add(trees, tree, op->operands);
-			} else {
-				n = add(trees, tree, {rule->right});
-			}
-			n->rule = rule;
-		}
+const parser::Tree& Parser::tree(const string& type) const {
+	auto it = trees.find(type);
+	if (it == trees.end()) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
 	}
-	Expr* parse(string& src, const string& type);
+	return it->second;
+}
 
-	Grammar& grammar;
-	map<string, parser::Tree> trees;
-};
+Expr* Parser::parse(Source src, const string& type, ExprArena* arena, bool packrat) const {
+	ParseContext& ctx = ParseContext::local();
+	parser::CharInput in(src.beg, src.end, blanks, ctx.scans, ctx.skips);
+	return parse(in, src.beg, tree(type), arena, packrat, ctx.chars, ctx.vm_chars);
+}
 
-string show(const Parser& parser) {
-	string ret;
-	for (auto& p : parser.trees) {
-		if (p.second.size()) {
-			ret += "tree for " + p.first + ":\n";
-			ret += show(p.second) + "\n";
-		}
+bool Parser::parse(Source src, const string& type, FlatTree& out, bool packrat) const {
+	ParseContext& ctx = ParseContext::local();
+	out.nodes.clear();
+	if (packrat || engine != BYTECODE) {
+		out.assign(parse(src, type, &ctx.arena, packrat), src.beg);
+		ctx.arena.clear();
+		return !out.empty();
 	}
-	return ret;
+	parser::CharInput in(src.beg, src.end, blanks, ctx.scans, ctx.skips);
+	StrIter pos = src.beg;
+	if (!vm::run(program, program.index.at(&tree(type)), in, pos, parser::Context{nullptr, nullptr, nullptr, &ctx.flat}, ctx.vm_chars)) return false;
+	in.skip(pos);
+	if (pos != src.end) return false;
+	ctx.flat.finish(out);
+	return true;
 }
 
+bool Parser::parse(Source src, const string& type, Handler& handler) const {
+	ParseContext& ctx = ParseContext::local();
+	parser::CharInput in(src.beg, src.end, blanks, ctx.scans, ctx.skips);
+	const parser::Tree& t = tree(type);
+	Events events{&handler, nullptr, ctx.events, src.beg, 0, expr::Lexeme(src.beg, src.beg)};
+	ctx.events.clear();
+	StrIter pos = src.beg;
+	in.skip(pos);
+	ctx.events.push_back(Event{Event::ENTER, grammar.symb_map.at(type)->id, in.offset(pos), in.offset(pos)});
+	if (!vm::run(program, program.index.at(&t), in, pos, parser::Context{nullptr, nullptr, &events, nullptr}, ctx.vm_chars)) return false;
+	in.skip(pos);
+	return pos == src.end;
+}
 
-Expr* Parser::parse(string& src, const string& type) {
-	StrIter beg = src.begin();
-	if (Expr* expr = parse_LL(beg, src.end(), grammar.skipper, trees[type])) {
-		while (beg != src.end() && grammar.skipper(*beg)) ++beg;
-		if (beg == src.end()) return expr;
-		delete expr;
-	}
-	return nullptr;
+/**
+ * Same as Parser::parse, but the source is split into tokens by the lexer first,
+ * so that backtracking does not rescan the text. Note that with a lexer
+ * a keyword is never matched by a regexp of the same length.
+ */
+Expr* Parser::parse_tokens(Source src, const string& type, ExprArena* arena, bool packrat) const {
+	ParseContext& ctx = ParseContext::local();
+	if (!lexer.tokenize(src.beg, src.end, ctx.lexemes)) return nullptr;
+	parser::TokenInput in(ctx.lexemes, src.end, lexer.epsilon);
+	return parse(in, in.origin, tree(type), arena, packrat, ctx.tokens, ctx.vm_tokens);
 }
 
 }
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "std.hpp"
+
+namespace dynaparse {
+
+/**
+ * Work-stealing pool for batches of independent tasks 0, ..., n - 1.
+ * Each worker starts with an equal contiguous range of tasks and takes
+ * them from its front; a worker which ran out of tasks steals the back
+ * half of the range of another one. Small uneven tasks are thus balanced
+ * without a shared queue.
+ *
+ * The threads live as long as the pool and sleep between batches, so
+ * a batch costs no thread start and the thread_local state of the workers
+ * (see ParseContext) stays warm. Batches of one pool run one at a time:
+ * a task must not run a batch of its own pool.
+ */
+class WorkPool {
+public:
+	WorkPool(uint count = 0) :
+		workers(count ? count : std::max(1u, std::thread::hardware_concurrency())),
+		batch_mutex(), mutex(), wake(), done(), work(), batch(0), width(0), busy(0), stop(false), threads() {
+		for (uint w = 1; w < workers; ++ w) threads.emplace_back(&WorkPool::serve, this, w);
+	}
+	WorkPool(const WorkPool&) = delete;
+	WorkPool& operator = (const WorkPool&) = delete;
+	~ WorkPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		wake.notify_all();
+		for (std::thread& t : threads) t.join();
+	}
+
+	/// Calls task(i) for every i in [0, n), the calling thread is one of the workers.
+	template<class Task>
+	void run(size_t n, Task task) {
+		std::lock_guard<std::mutex> batch_lock(batch_mutex);
+		uint k = std::max<size_t>(1, std::min<size_t>(workers, n));
+		std::unique_ptr<Range[]> ranges(new Range[k]);
+		for (uint w = 0; w < k; ++ w) {
+			ranges[w].beg = n * w / k;
+			ranges[w].end = n * (w + 1) / k;
+		}
+		std::exception_ptr error;
+		std::mutex error_mutex;
+		auto body = [&](uint w) {
+			try {
+				for (size_t i; ; ) {
+					if (pop(ranges[w], i)) task(i);
+					else if (!steal(ranges.get(), k, w)) break;
+				}
+			} catch (...) {
+				std::lock_guard<std::mutex> lock(error_mutex);
+				if (!error) error = std::current_exception();
+			}
+		};
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			work = body;
+			width = k;
+			busy = k - 1;
+			++ batch;
+		}
+		if (k > 1) wake.notify_all();
+		body(0);
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [this]() { return !busy; });
+			work = nullptr;
+		}
+		if (error) std::rethrow_exception(error);
+	}
+
+	const uint workers;
+
+private:
+	struct Range {
+		std::mutex mutex;
+		size_t     beg;
+		size_t     end;
+	};
+	/// The loop of worker w: it takes part in the batches, which are wide enough.
+	void serve(uint w) {
+		size_t seen = 0;
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true) {
+			wake.wait(lock, [&]() { return stop || batch != seen; });
+			if (stop) return;
+			seen = batch;
+			if (w >= width) continue;
+			lock.unlock();
+			work(w);
+			lock.lock();
+			if (!-- busy) done.notify_one();
+		}
+	}
+	static bool pop(Range& r, size_t& i) {
+		std::lock_guard<std::mutex> lock(r.mutex);
+		if (r.beg == r.end) return false;
+		i = r.beg ++;
+		return true;
+	}
+	static bool steal(Range* ranges, uint k, uint w) {
+		for (uint d = 1; d < k; ++ d) {
+			Range& victim = ranges[(w + d) % k];
+			size_t b, e;
+			{
+				std::lock_guard<std::mutex> lock(victim.mutex);
+				if (victim.beg == victim.end) continue;
+				b = victim.beg + (victim.end - victim.beg) / 2;
+				e = victim.end;
+				victim.end = b;
+			}
+			std::lock_guard<std::mutex> lock(ranges[w].mutex);
+			ranges[w].beg = b;
+			ranges[w].end = e;
+			return true;
+		}
+		return false;
+	}
+
+	std::mutex                batch_mutex; // held by the running batch
+	std::mutex                mutex;       // guards the fields of the batch below
+	std::condition_variable   wake;
+	std::condition_variable   done;
+	std::function<void(uint)> work;
+	size_t                    batch;       // the number of batches so far
+	uint                      width;       // the workers of the batch
+	uint                      busy;        // the workers of the batch, which did not finish
+	bool                      stop;
+	vector<std::thread>       threads;
+};
+
+}
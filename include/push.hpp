@@ -0,0 +1,173 @@
+#pragma once
+
+#include "parser.hpp"
+
+namespace dynaparse {
+
+/**
+ * Parses a source, which comes in chunks: feed() runs the parse as far as
+ * the input allows, finish() ends the input. The parse is delivered as events
+ * (see StreamHandler) as soon as they are final, the same way Parser::parse
+ * delivers them to a Handler. When an instruction of the bytecode would read
+ * past the input fed so far, the machine is suspended and the next chunk
+ * resumes it (see vm::run), so the text is not parsed again.
+ *
+ * The buffer keeps the text from the first position, which a backtrack entry
+ * or an undelivered token still refers to, the text before it is released:
+ * memory is bounded by the lookahead and the undecided part of the parse,
+ * the stack by the nesting of the parse. An iteration flattened into
+ * recursion (see Grammar::flaten_ebnf) nests with every element, though.
+ * A token, which a regexp unsupported by the DFA matches, waits for finish().
+ */
+class PushParser {
+public:
+	PushParser(const Parser& p, const string& type, StreamHandler& h);
+
+	/// Parses a chunk as far as it goes, returns false once the parse failed.
+	bool feed(Source chunk);
+	/// Ends the input, returns whether the whole of it is parsed.
+	bool finish();
+
+	bool failed() const { return state == FAILED; }
+	/// The offset of the first char still buffered.
+	size_t released() const { return base; }
+	size_t buffered() const { return buffer.size(); }
+
+private:
+	/// The text in the buffer: positions are offsets from the beginning of the stream.
+	struct Input {
+		typedef size_t Pos;
+		/// Stays, if skipping may go on after the end so far: a line comment is closed there then.
+		void skip(Pos& p) const {
+			StrIter b = beg(p), q = b;
+			if (q != last && blanks.starts(*q)) blanks.skip(q, last);
+			if (!final && blanks.cut(q, last)) hungry = true;
+			else p += q - b;
+		}
+		uint peek(Pos p) const {
+			if (beg(p) != last) return static_cast<unsigned char>(*beg(p));
+			if (!final) hungry = true;
+			return Analysis::END;
+		}
+		bool match(const parser::Node& n, Pos& p) const {
+			StrIter b = beg(p), q = b;
+			if (!final && runs_out(n, b)) {
+				hungry = true;
+				return false;
+			}
+			if (!n.symb->matches(q, last)) return false;
+			p += q - b;
+			return true;
+		}
+		/// The match may depend on the chars after the end so far.
+		bool runs_out(const parser::Node& n, StrIter b) const {
+			if (n.kind == Symb::KEYWORD) return size_t(last - b) < static_cast<const symb::Keyword*>(n.symb)->body.size();
+			const Dfa& dfa = static_cast<const symb::Regexp*>(n.symb)->dfa;
+			return !dfa.valid() || dfa.extent(b, last) > size_t(last - b);
+		}
+		void    touch(size_t) const { }
+		bool    starved() const { return hungry; }
+		size_t  offset(Pos p) const { return p; }
+		Pos     at(size_t o) const { return o; }
+		/// The released text maps to the beginning of the buffer.
+		StrIter beg(Pos p) const { return p < base ? text : text + (p - base); }
+		StrIter end(Pos, Pos p) const { return beg(p); }
+
+		StrIter       text;
+		size_t        base; // the offset of text
+		StrIter       last;
+		bool          final; // the input ends at last
+		const Blanks& blanks;
+		mutable bool  hungry;
+	};
+
+	enum State { START, RUNNING, DONE, FAILED };
+
+	bool run(bool final);
+	void release(size_t keep);
+
+	const Parser&     parser;
+	uint              start;  // the non-terminal in the program
+	uint              symb;   // and in the grammar
+	StreamHandler&    handler;
+	string            buffer;
+	size_t            base;   // the offset of the buffer in the stream
+	vector<Event>     pending;
+	vm::Stack<size_t> stack;
+	size_t            pos;    // START: where the parse begins, DONE: where it ended
+	State             state;
+};
+
+PushParser::PushParser(const Parser& p, const string& type, StreamHandler& h) :
+	parser(p), start(0), symb(0), handler(h), buffer(), base(0), pending(), stack(), pos(0), state(START) {
+	auto it = p.trees.find(type);
+	if (it == p.trees.end()) {
+		std::cerr << "undefined symbol: " << type << std::endl;
+		throw std::exception();
+	}
+	start = p.program.index.at(&it->second);
+	symb = p.grammar.symb_map.at(type)->id;
+}
+
+bool PushParser::feed(Source chunk) {
+	if (state == FAILED) return false;
+	buffer.append(chunk.beg, chunk.end);
+	return run(false);
+}
+
+bool PushParser::finish() {
+	return run(true) && state == DONE;
+}
+
+bool PushParser::run(bool final) {
+	if (state == FAILED) return false;
+	Input in{buffer.data(), base, buffer.data() + buffer.size(), final, parser.blanks, false};
+	if (state == START) {
+		in.skip(pos);
+		if (in.starved()) {
+			release(pos);
+			return true;
+		}
+		pending.push_back(Event{Event::ENTER, symb, pos, pos});
+		state = RUNNING;
+	}
+	if (state == RUNNING) {
+		Events events{nullptr, &handler, pending, buffer.data(), base, expr::Lexeme(in.text, in.text)};
+		size_t end = pos;
+		Expr* ex = vm::run(parser.program, start, in, end, parser::Context{nullptr, nullptr, &events, nullptr}, stack);
+		if (stack.suspended) {
+			size_t keep = stack.resume.pos;
+			for (const vm::Entry<size_t>& e : stack.entries) {
+				if (e.tree == vm::Entry<size_t>::CHOICE) keep = std::min(keep, e.pos);
+			}
+			for (const Event& e : pending) {
+				if (e.kind == Event::TOKEN) keep = std::min(keep, e.beg);
+			}
+			release(keep);
+			return true;
+		}
+		if (!ex) {
+			state = FAILED;
+			return false;
+		}
+		pos = end;
+		state = DONE;
+	}
+	// only blanks may follow
+	in.skip(pos);
+	if (!in.starved() && in.beg(pos) != in.last) {
+		state = FAILED;
+		return false;
+	}
+	release(pos);
+	return true;
+}
+
+/// Drops the text before keep, once it is the larger part of the buffer.
+void PushParser::release(size_t keep) {
+	if (keep - base < buffer.size() / 2) return;
+	buffer.erase(0, keep - base);
+	base = keep;
+}
+
+}
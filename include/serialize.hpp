@@ -0,0 +1,126 @@
+#pragma once
+
+#include "expr.hpp"
+
+namespace dynaparse {
+
+/**
+ * Writers of parse trees into an output (StreamOut, StringOut, BufferOut or
+ * any class with write(const char*, size_t)). They walk the tree with visit,
+ * so deep trees are fine, and write the pieces of the text as they go,
+ * without building strings. A node is named by the non-terminal of its rule,
+ * an Indexed node (which has no grammar) by #id of its rule.
+ */
+namespace serialize {
+
+template<class Out>
+void put(Out& out, const char* s) { out.write(s, std::strlen(s)); }
+
+template<class Out>
+void put(Out& out, uint v) {
+	char buf[16];
+	char* p = buf + sizeof(buf);
+	do *-- p = '0' + v % 10; while (v /= 10);
+	out.write(p, buf + sizeof(buf) - p);
+}
+
+/// A string literal: quotes, backslashes and control chars are escaped, other bytes are kept.
+template<class Out>
+void quoted(Out& out, StrIter b, StrIter e) {
+	static const char hex[] = "0123456789abcdef";
+	out.write("\"", 1);
+	StrIter run = b;
+	for (StrIter p = b; p != e; ++ p) {
+		unsigned char c = *p;
+		if (c >= ' ' && c != '"' && c != '\\') continue;
+		out.write(run, p - run);
+		run = p + 1;
+		switch (c) {
+		case '"':  out.write("\\\"", 2); break;
+		case '\\': out.write("\\\\", 2); break;
+		case '\n': out.write("\\n", 2); break;
+		case '\t': out.write("\\t", 2); break;
+		case '\r': out.write("\\r", 2); break;
+		default: {
+			char u[] = {'\\', 'u', '0', '0', hex[c >> 4], hex[c & 15]};
+			out.write(u, sizeof(u));
+		}
+		}
+	}
+	out.write(run, e - run);
+	out.write("\"", 1);
+}
+
+/// The name of a node, quoted as a string literal, if quote is set.
+template<class Out>
+void name(Out& out, const expr::Operator& op, bool quote = false) {
+	if (op.rule) {
+		const string& n = op.rule->left->name;
+		if (quote) quoted(out, n.data(), n.data() + n.size());
+		else out.write(n.data(), n.size());
+	} else {
+		if (quote) out.write("\"", 1);
+		out.write("#", 1);
+		put(out, op.rule_id());
+		if (quote) out.write("\"", 1);
+	}
+}
+
+}
+
+/// Writes a tree as an S-expression: (E (T "1") "+" (T "2")).
+template<class Out>
+void write_sexpr(Out& out, const Expr& root) {
+	struct SExpr {
+		bool enter(const Expr& e, uint depth) {
+			if (depth) out.write(" ", 1);
+			if (e.kind == Expr::LEXEME) {
+				serialize::quoted(out, e.beg, e.end);
+			} else {
+				out.write("(", 1);
+				serialize::name(out, static_cast<const expr::Operator&>(e));
+			}
+			return true;
+		}
+		void leave(const Expr& e, uint) {
+			if (e.kind == Expr::OPERATOR) out.write(")", 1);
+		}
+		Out& out;
+	} w{out};
+	visit(root, w);
+}
+
+/**
+ * Writes a tree as JSON: a node of a rule is an object
+ * {"rule": "E", "id": 2, "children": [...]}, a lexeme is a string.
+ */
+template<class Out>
+void write_json(Out& out, const Expr& root) {
+	struct Json {
+		bool enter(const Expr& e, uint) {
+			if (!first) out.write(",", 1);
+			first = false;
+			if (e.kind == Expr::LEXEME) {
+				serialize::quoted(out, e.beg, e.end);
+				return true;
+			}
+			const expr::Operator& op = static_cast<const expr::Operator&>(e);
+			serialize::put(out, "{\"rule\":");
+			serialize::name(out, op, true);
+			serialize::put(out, ",\"id\":");
+			serialize::put(out, op.rule_id());
+			serialize::put(out, ",\"children\":[");
+			first = true;
+			return true;
+		}
+		void leave(const Expr& e, uint) {
+			if (e.kind == Expr::OPERATOR) out.write("]}", 2);
+			first = false;
+		}
+		Out& out;
+		bool first; // no comma before the node
+	} w{out, true};
+	visit(root, w);
+}
+
+}
@@ -2,18 +2,29 @@
 
 #include <string>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <vector>
 #include <stack>
 #include <queue>
 
 #include <utility>
+#include <cstddef>
+#include <cstring>
 #include <iostream>
 #include <unistd.h>
 #include <stdint.h>
 #include <algorithm>
 #include <cassert>
 #include <regex>
+#include <bitset>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
 #include <stdarg.h>
 #include <initializer_list>
 
@@ -21,6 +32,7 @@ namespace dynaparse {
 
 using std::string;
 using std::map;
+using std::unordered_map;
 using std::vector;
 using std::ostream;
 using std::pair;
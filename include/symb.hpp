@@ -1,19 +1,36 @@
 #pragma once
 
-#include "std.hpp"
+#include "dfa.hpp"
 
 namespace dynaparse {
 
-typedef string::const_iterator StrIter;
+/// Sources are parsed in place as contiguous read-only character ranges.
+typedef const char* StrIter;
 
+/**
+ * Symbols carry a kind tag, so that matching and comparison dispatch
+ * with a switch instead of virtual calls and dynamic_cast. Inside a grammar
+ * every symbol gets a dense id, equal symbols share it (see Grammar::operator <<).
+ */
 struct Symb {
+	enum Kind : uint8_t { NONTERM, KEYWORD, REGEXP };
+	enum { NO_ID = uint(-1) };
 	string name;
+	Kind   kind;
+	uint   id;
 	Symb(const Symb&) = default;
-	Symb(const string& n) : name(n) { }
+	Symb(const string& n, Kind k) : name(n), kind(k), id(NO_ID) { }
 	virtual ~ Symb() { }
 	virtual string show() const = 0;
-	virtual bool matches(StrIter& ch, StrIter end) const  = 0;
-	virtual bool equals(const Symb* s) const = 0;
+	virtual Symb* clone() const = 0;
+	/// The string which identifies a symbol of the given kind: a name or a body.
+	const string& key() const;
+	bool matches(StrIter& ch, StrIter end) const;
+	bool equals(const Symb* s) const {
+		if (kind != s->kind) return false;
+		if (id != NO_ID && s->id != NO_ID) return id == s->id;
+		return key() == s->key();
+	}
 };
 
 struct Symbs {
@@ -24,65 +41,80 @@ namespace symb {
 
 struct Lexeme : public Symb {
 	Lexeme(const Lexeme&) = default;
-	Lexeme(const string& n) : Symb(n) { }
+	Lexeme(const string& n, Kind k) : Symb(n, k) { }
 };
 
 struct Nonterm : public Symb {
 	Nonterm(const Nonterm& nt) = default;
-	Nonterm(const string& n) : Symb(n) { }
+	Nonterm(const string& n) : Symb(n, NONTERM) { }
 	virtual ~ Nonterm() { }
 	virtual string show() const { return "Nonterm: " + name; }
-	virtual bool matches(StrIter&, StrIter) const { return false; }
-	virtual bool equals(const Symb* s) const {
-		if (const Nonterm* nt = dynamic_cast<const Nonterm*>(s)) {
-			return name == nt->name;
-		} else return false;
-	}
+	virtual Symb* clone() const { return new Nonterm(*this); }
 };
 
 struct Keyword : public Lexeme {
 	string body;
 	Keyword(const Keyword& kw) = default;
-	Keyword(const string& b) : Lexeme(b), body(b) { }
-	Keyword(const string& n, const string& b) : Lexeme(n), body(b) { }
+	Keyword(const string& b) : Lexeme(b, KEYWORD), body(b) { }
+	Keyword(const string& n, const string& b) : Lexeme(n, KEYWORD), body(b) { }
 	virtual ~Keyword() { }
 	virtual string show() const { return "Keyword: " + body; }
-	virtual bool matches(StrIter& ch, StrIter end) const {
-		StrIter x = body.begin();
-		for (; x != body.end() && ch != end; ++x, ++ch) {
+	virtual Symb* clone() const { return new Keyword(*this); }
+	bool matches(StrIter& ch, StrIter end) const {
+		StrIter x = body.data();
+		StrIter e = x + body.size();
+		for (; x != e && ch != end; ++x, ++ch) {
 			if (*x != *ch) return false;
 		}
-		return ch != end || x == body.end();
-	}
-	virtual bool equals(const Symb* s) const {
-		if (const Keyword* t = dynamic_cast<const Keyword*>(s)) {
-			return body == t->body;
-		} else return false;
+		return ch != end || x == e;
 	}
 };
 
+/**
+ * Regular expression lexeme. Matching goes through the DFA, std::regex
+ * is used for the patterns the DFA does not support (or when it grows too
+ * big). Both give the same match: the first alternative, which matches.
+ */
 struct Regexp : public Lexeme {
 	string body;
 	regex  regexp;
-	Regexp(const Regexp& re) : Lexeme(re), body(re.body), regexp(re.regexp) { }
-	Regexp(const string& n, const string& b) : Lexeme(n), body(b), regexp(b) { }
+	Dfa    dfa;
+	Regexp(const Regexp& re) : Lexeme(re), body(re.body), regexp(re.regexp), dfa(re.dfa) { }
+	Regexp(const string& n, const string& b) : Lexeme(n, REGEXP), body(b), regexp(b), dfa(b) { }
 	virtual ~ Regexp() { }
 	virtual string show() const { return "Regexpr: " + name + " definition: " + body; }
-	virtual bool matches(StrIter& ch, StrIter end) const {
-		std::smatch m;
-		bool ret = std::regex_search(ch, end, m, regexp, std::regex_constants::match_continuous);
-		if (ret) ch += m.length();
-		return ret;
-	}
-	virtual bool equals(const Symb* s) const {
-		if (const Regexp* r = dynamic_cast<const Regexp*>(s)) {
-			return body == r->body;
-		} else return false;
+	virtual Symb* clone() const { return new Regexp(*this); }
+	bool matches(StrIter& ch, StrIter end) const {
+		int len = dfa.valid() ? dfa.match(ch, end) : -2;
+		if (len == -2) {
+			std::cmatch m;
+			if (!std::regex_search(ch, end, m, regexp, std::regex_constants::match_continuous)) return false;
+			len = m.length();
+		}
+		if (len < 0) return false;
+		ch += len;
+		return true;
 	}
 };
 
 }
 
+inline const string& Symb::key() const {
+	switch (kind) {
+	case KEYWORD: return static_cast<const symb::Keyword*>(this)->body;
+	case REGEXP:  return static_cast<const symb::Regexp*>(this)->body;
+	default:      return name;
+	}
+}
+
+inline bool Symb::matches(StrIter& ch, StrIter end) const {
+	switch (kind) {
+	case KEYWORD: return static_cast<const symb::Keyword*>(this)->matches(ch, end);
+	case REGEXP:  return static_cast<const symb::Regexp*>(this)->matches(ch, end);
+	default:      return false;
+	}
+}
+
 inline Symb* Keyword(const string& n) { return new symb::Keyword(n); }
 inline Symb* Keyword(const string& n, const string& b) { return new symb::Keyword(n, b); }
 inline Symb* Nonterm(const string& n) { return new symb::Nonterm(n); }
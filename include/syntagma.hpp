@@ -9,10 +9,12 @@ struct Operator;
 }
 
 struct Syntagma {
+	enum Kind : uint8_t { REF, SEQ, ALT, ITER, OPT };
 	Rule*           rule;
 	rule::Operator* parent;
 	int             place;
-	Syntagma() : rule(nullptr), parent(nullptr), place(-1) { }
+	Kind            kind;
+	Syntagma(Kind k) : rule(nullptr), parent(nullptr), place(-1), kind(k) { }
 	virtual ~ Syntagma() { }
 	virtual string show() const = 0;
 	virtual void complete(Grammar*, Rule*) = 0;
@@ -27,8 +29,8 @@ namespace rule {
 struct Ref : public Syntagma {
 	string name;
 	Symb*  ref;
-	Ref(const string& n) : Syntagma(), name(n), ref(nullptr) { }
-	Ref(Symb* r) : name(r->name), ref(r) { }
+	Ref(const string& n) : Syntagma(REF), name(n), ref(nullptr) { }
+	Ref(Symb* r) : Syntagma(REF), name(r->name), ref(r) { }
 	virtual ~ Ref() { }
 	virtual string show() const {
 		if (!ref) return name.size() ? name : "<EMPTY>";
@@ -47,7 +49,7 @@ struct Ref : public Syntagma {
 };
 
 struct Operator : public Syntagma {
-	Operator() : Syntagma() { }
+	Operator(Kind k) : Syntagma(k) { }
 	virtual ~ Operator() { }
 	virtual int arity() const = 0;
 	virtual Syntagma*& get(uint = 0) = 0;
@@ -55,14 +57,13 @@ struct Operator : public Syntagma {
 	virtual void insert(int i, Syntagma* s) = 0;
 	virtual void insert(int i, const vector<Syntagma*>& op) = 0;
 	virtual void erase(int i) = 0;
-	virtual bool flaten(Grammar*) = 0;
 	void check() const {
 		for (int i = 0; i < arity(); ++ i) get(i)->check();
 	}
 };
 
 struct NaryOperator : public Operator {
-	NaryOperator(const vector<Syntagma*>& op) : Operator(), operands(op) {
+	NaryOperator(Kind k, const vector<Syntagma*>& op) : Operator(k), operands(op) {
 		assert(operands.size());
 		for (uint i = 0; i < operands.size(); ++ i) {
 			Syntagma* s = operands[i];
@@ -78,7 +79,6 @@ struct NaryOperator : public Operator {
 	virtual void complete(Grammar* grammar, Rule* rule) {
 		assert(operands.size());
 		Syntagma::rule = rule;
-		grammar->to_flaten.insert(this);
 		for (auto s : operands) s->complete(grammar, rule);
 	}
 	virtual int arity() const { return operands.size(); }
@@ -126,7 +126,7 @@ struct NaryOperator : public Operator {
 };
 
 struct UnaryOperator : public Operator {
-	UnaryOperator(Syntagma* op) : Operator(), operand(op) {
+	UnaryOperator(Kind k, Syntagma* op) : Operator(k), operand(op) {
 		assert(operand);
 		operand->parent = this;
 		operand->place = 0;
@@ -135,7 +135,6 @@ struct UnaryOperator : public Operator {
 	virtual void complete(Grammar* grammar, Rule* rule) {
 		assert(operand);
 		Syntagma::rule = rule;
-		grammar->to_flaten.insert(this);
 		operand->complete(grammar, rule);
 	}
 	virtual int arity() const { return 1; }
@@ -169,33 +168,16 @@ struct UnaryOperator : public Operator {
 };
 
 struct Seq : public NaryOperator {
-	Seq(const vector<Syntagma*>& op) : NaryOperator(op) { }
+	Seq(const vector<Syntagma*>& op) : NaryOperator(SEQ, op) { }
 	virtual ~ Seq() { }
 	virtual string show() const {
 		return NaryOperator::show();
 	}
-	/**
-	 * Rule:
-	 * 		M -> alpha (beta gamma) delta
-	 * Transforms to:
-	 *  	M -> alpha beta gamma delta
-	 */
-	virtual bool flaten(Grammar* grammar) {
-		if (!parent) return false;
-		if (Seq* seq = dynamic_cast<Seq*>(parent)) {
-			seq->erase(place);
-			seq->insert(place, operands);
-			operands.clear();
-			parent->check();
-			return true;
-		}
-		return false;
-	}
 	virtual Syntagma* clone() const { return new Seq(clone_operands()); }
 };
 
 struct Alt : public NaryOperator {
-	Alt(const vector<Syntagma*>& op) : NaryOperator(op) { }
+	Alt(const vector<Syntagma*>& op) : NaryOperator(ALT, op) { }
 	virtual ~ Alt() { }
 	virtual string show() const {
 		return 
@@ -203,160 +185,24 @@ struct Alt : public NaryOperator {
 			"( " + NaryOperator::show_with_delim(" | ") + " )" : 
 			NaryOperator::show_with_delim(" | ");
 	}
-	/**
-	 * Rule:
-	 * 		M -> alpha ( beta | gamma | delta ) epsilon
-	 * Transforms to:
-	 *   	M -> alpha N epsilon
-	 *  	N -> beta
-	 *  	N -> gamma
-	 *  	N -> delta
-	 *
-	 * Rule:
-	 * 		M -> beta | gamma | delta (*)
-	 * Transforms to:
-	 *  	M -> beta
-	 *  	M -> gamma
-	 *  	M -> delta (*)
-	 */
-	virtual bool flaten(Grammar* grammar) {
-		symb::Nonterm* nt =
-			parent ?
-			grammar->fresh_nonterm() :
-			dynamic_cast<symb::Nonterm*>(rule->left->ref);
-
-		if (parent) {
-			parent->erase(place);
-			parent->insert(place, new Ref(nt));
-		} else {
-			rule->right = operands.back();
-			rule->right->parent = nullptr;
-			operands.pop_back();
-		}
-		for (Syntagma* s : operands) {
-			s->parent = nullptr;
-			s->check();
-			*grammar << Rule(new Ref(nt), s);
-		}
-		if (parent) parent->check();
-		operands.clear();
-		return true;
-	}
 	virtual Syntagma* clone() const { return new Alt(clone_operands()); }
 };
 
 struct Iter : public UnaryOperator {
-	Iter(Syntagma* op) : UnaryOperator(op) { assert(op); }
+	Iter(Syntagma* op) : UnaryOperator(ITER, op) { assert(op); }
 	virtual ~ Iter() { }
 	virtual string show() const {
 		return "{ " + operand->show() + " }";
 	}
-	/**
-	 * Rule:
-	 * 		M -> alpha { beta } gamma
-	 * Transforms to:
-	 *  	M -> alpha N gamma
-	 *  	N -> ""
-	 *  	N -> beta N
-	 *
-	 * Rule:
-	 * 		M -> { beta }
-	 * Transforms to:
-	 *  	M -> ""
-	 *  	M -> beta M
-	 */
-	virtual bool flaten(Grammar* grammar) {
-		symb::Nonterm* nt = grammar->fresh_nonterm();
-		if (parent) {
-			parent->erase(place);
-			parent->insert(place, new Ref(nt));
-			Seq* seq = nullptr;
-			if (dynamic_cast<Seq*>(operand)) {
-				seq = dynamic_cast<Seq*>(operand);
-				seq->parent = nullptr;
-			} else {
-				seq = new Seq({operand});
-			}
-			seq->insert(seq->arity(), new Ref(nt));
-			seq->check();
-			*grammar << Rule(new Ref(nt), seq);
-		} else {
-			rule->right = new Ref(nt);
-			Seq* seq = nullptr;
-			if (dynamic_cast<Seq*>(operand)) {
-				seq = dynamic_cast<Seq*>(operand);
-				seq->parent = nullptr;
-			} else {
-				seq = new Seq({operand});
-			}
-			seq->insert(seq->arity(), new Ref(nt));
-			seq->check();
-			*grammar << Rule(new Ref(nt), seq);
-		}
-		*grammar << Rule(new Ref(nt), new Ref(""));
-		if (parent) parent->check();
-		operand = nullptr;
-		return true;
-	}
 	virtual Syntagma* clone() const { return new Iter(operand->clone()); }
 };
 
 struct Opt : public UnaryOperator {
-	Opt(Syntagma* op) : UnaryOperator(op) { }
+	Opt(Syntagma* op) : UnaryOperator(OPT, op) { }
 	virtual ~ Opt() { }
 	virtual string show() const {
 		return "[ " + operand->show() + " ]";
 	}
-	/**
-	 * Rule:
-	 * 		M -> alpha [ beta ] gamma
-	 * Transforms to:
-	 *  	M -> alpha N gamma
-	 *  	N -> ""
-	 *  	N-> beta
-	 *
-	 * Rule:
-	 * 		M -> [ beta ]
-	 * Transforms to:
-	 *  	M -> ""
-	 *  	M-> beta
-	 *
-	 */
-	virtual bool flaten(Grammar* grammar) {
-		symb::Nonterm* nt =
-			parent ?
-			grammar->fresh_nonterm() :
-			dynamic_cast<symb::Nonterm*>(rule->left->ref);
-
-		if (parent) {
-			parent->erase(place);
-			parent->insert(place, new Ref(nt));
-			Syntagma* op = dynamic_cast<Ref*>(operand) ? new Seq({operand}) : operand;
-			op->parent = nullptr;
-			op->check();
-			*grammar << Rule(new Ref(nt), op);
-		} else {
-			rule->right = operand;
-			operand->parent = nullptr;
-			if (Operator* op = dynamic_cast<Operator*>(operand)) {
-				op->insert(op->arity(), new Ref(nt));
-				op->check();
-			} else {
-				std::cerr << "right side of a rule cannot be ref" << std::endl;
-				throw std::exception();
-			}
-		}
-		*grammar << Rule(new Ref(nt), new Ref(""));
-		if (parent) parent->check();
-		operand = nullptr;
-		return true;
-	}
-	virtual void complete(Grammar* grammar, Rule* rule) {
-		assert(operand);
-		Syntagma::rule = rule;
-		grammar->to_flaten.insert(this);
-		operand->complete(grammar, rule);
-	}
 	virtual Syntagma* clone() const { return new Opt(operand->clone()); }
 };
 
@@ -392,8 +238,8 @@ Rule::~Rule() {
 }
 
 Rule::Rule(Syntagma* l, Syntagma* r) :
-	left(dynamic_cast<rule::Ref*>(l)),
-	right(dynamic_cast<rule::Ref*>(r) ? new rule::Seq({r}) : r) {
+	left(l && l->kind == Syntagma::REF ? static_cast<rule::Ref*>(l) : nullptr),
+	right(r && r->kind == Syntagma::REF ? new rule::Seq({r}) : r), id(Symb::NO_ID) {
 	if (!left) {
 		std::cerr << "left side of a rule must be a reference to non-terminal" << std::endl;
 		throw std::exception();
@@ -402,8 +248,9 @@ Rule::Rule(Syntagma* l, Syntagma* r) :
 
 Rule* Rule::clone() const { return new Rule(left->clone(), right->clone()); }
 
-Grammar::Grammar(const string& n) : name(n), symb_map(), symbs(), rules(), to_flaten(),
-	skipper([](char c)->bool {return c <= ' '; }), fresh_nonterm_index(0) {
+Grammar::Grammar(const string& n) : name(n), symb_map(), symbs(), symb_ids(), rules(), flat(0),
+	skipper([](char c)->bool {return c <= ' '; }), comments(), fresh_nonterm_index(0), revision(0), fp() {
+	fp.revision = uint64_t(-1);
 	operator << (Keyword(""));
 }
 
@@ -415,40 +262,242 @@ Grammar& Grammar::operator << (Rule&& rule) {
 }
 
 void Grammar::add(Rule* r) {
+	changed();
+	r->id = rules.size();
 	rules.push_back(r);
 	rules.back()->left->complete(this, r);
 	rules.back()->right->complete(this, r);
 }
 
+void Grammar::remove(Rule* r) {
+	changed();
+	if (r->id < flat) -- flat;
+	rules.erase(rules.begin() + r->id);
+	for (uint i = r->id; i < rules.size(); ++ i) rules[i]->id = i;
+	delete r;
+}
+
 Grammar& Grammar::operator << (Symb* s) {
+	changed();
+	auto key = std::make_pair(static_cast<int>(s->kind), s->key());
+	auto it = symb_ids.find(key);
+	if (it == symb_ids.end()) {
+		uint id = symb_ids.size();
+		it = symb_ids.emplace(key, id).first;
+	}
+	s->id = it->second;
 	symbs.push_back(s);
 	symb_map[s->name] = s;
  	return *this;
 }
 
 
-void Grammar::flaten_ebnf() {
-	while (!to_flaten.empty()) {
-		rule::Operator* op = *to_flaten.begin();
-/*
-		bool show_it = true;
-		if (rule::Seq* seq = dynamic_cast<rule::Seq*>(op)) {
-			if (!seq->parent || !dynamic_cast<rule::Seq*>(seq->parent)) show_it = false;
+/// Points the references of a cloned syntagma to the cloned symbols.
+inline void relink(Syntagma* s, Rule* rule, const map<const Symb*, Symb*>& copies) {
+	s->rule = rule;
+	if (s->kind == Syntagma::REF) {
+		rule::Ref* ref = static_cast<rule::Ref*>(s);
+		ref->ref = copies.at(ref->ref);
+	} else {
+		rule::Operator* op = static_cast<rule::Operator*>(s);
+		for (int i = 0; i < op->arity(); ++ i) relink(op->get(i), rule, copies);
+	}
+}
+
+/**
+ * Deep copy of a flattened grammar, which shares nothing with the original.
+ * Symbols and rules keep their ids.
+ */
+Grammar* Grammar::clone() const {
+	if (flat < rules.size()) {
+		std::cerr << "grammar must be flattened before cloning" << std::endl;
+		throw std::exception();
+	}
+	Grammar* ret = new Grammar(name);
+	for (Symb* s : ret->symbs) delete s; // the empty keyword is copied with the rest
+	ret->symbs.clear();
+	ret->symb_map.clear();
+	ret->symb_ids.clear();
+	map<const Symb*, Symb*> copies;
+	for (const Symb* s : symbs) {
+		Symb* c = s->clone();
+		copies[s] = c;
+		*ret << c;
+	}
+	for (const Rule* r : rules) {
+		Rule* c = r->clone();
+		relink(c->left, c, copies);
+		relink(c->right, c, copies);
+		c->id = ret->rules.size();
+		ret->rules.push_back(c);
+	}
+	ret->flat = flat;
+	ret->set_skipper(skipper);
+	ret->set_comments(comments);
+	ret->fresh_nonterm_index = fresh_nonterm_index;
+	return ret;
+}
+
+/**
+ * FNV-1a hash of the text of the grammar (its symbols, comments and rules
+ * in order) and of the characters the skipper skips. Computed once per revision.
+ */
+uint64_t Grammar::fingerprint() const {
+	std::lock_guard<std::mutex> lock(fp.mutex);
+	if (fp.revision == revision) return fp.value;
+	uint64_t h = 0xcbf29ce484222325ull;
+	auto add = [&h](unsigned char c) {
+		h ^= c;
+		h *= 0x100000001b3ull;
+	};
+	for (char c : show()) add(c);
+	Blanks blanks(skipper);
+	for (uint i = 0; i < 4; ++ i) {
+		for (uint b = 0; b < 64; b += 8) add(blanks.table()[i] >> b);
+	}
+	fp.revision = revision;
+	fp.value = h;
+	return h;
+}
+
+namespace rule {
+
+/**
+ * The pass of Grammar::flaten_ebnf over the right side of a rule. Nested
+ * sequences are spliced, the other operators are replaced by references to
+ * fresh non-terminals, whose rules are appended to the grammar and flattened,
+ * when the pass gets to them:
+ *
+ * 		M -> alpha (beta gamma) delta      =>  M -> alpha beta gamma delta
+ * 		M -> alpha ( beta | gamma ) delta  =>  M -> alpha N delta, N -> beta, N -> gamma
+ * 		M -> alpha { beta } gamma          =>  M -> alpha N gamma, N -> beta N, N -> ""
+ * 		M -> alpha [ beta ] gamma          =>  M -> alpha N gamma, N -> beta, N -> ""
+ *
+ * At the top of a rule no non-terminal is needed:
+ *
+ * 		M -> beta | gamma | delta  =>  M -> delta, M -> beta, M -> gamma
+ * 		M -> { beta }              =>  M -> N, N -> beta N, N -> ""
+ * 		M -> [ beta ]              =>  M -> beta, M -> ""
+ *
+ * The alternatives, which do not stay in place, are appended in order.
+ * Each syntagma is visited once and moved, not copied, so the pass is linear
+ * in the size of the grammar, and its outcome depends on the grammar only.
+ */
+struct Flattener {
+	Grammar& grammar;
+	Symb*    empty;
+
+	void flatten(Rule* r) {
+		Symb* left = r->left->ref;
+		Syntagma* right = r->right;
+		while (right->kind != Syntagma::SEQ) {
+			switch (right->kind) {
+			case Syntagma::ALT: {
+				vector<Syntagma*> alts = take(static_cast<Alt*>(right));
+				right = alts.back();
+				alts.pop_back();
+				for (Syntagma* s : alts) add(left, s);
+				break;
+			}
+			case Syntagma::ITER: {
+				symb::Nonterm* nt = grammar.fresh_nonterm();
+				iterate(nt, take(static_cast<UnaryOperator*>(right)));
+				right = new Seq({new Ref(nt)});
+				break;
+			}
+			case Syntagma::OPT:
+				right = take(static_cast<UnaryOperator*>(right));
+				add(left, new Ref(empty));
+				break;
+			default:
+				right = new Seq({right});
+			}
+		}
+		Seq* seq = static_cast<Seq*>(right);
+		vector<Syntagma*> flat;
+		flat.reserve(seq->operands.size());
+		for (Syntagma* s : seq->operands) lower(s, flat);
+		seq->operands.swap(flat);
+		seq->parent = nullptr;
+		seq->rule = r;
+		for (uint i = 0; i < seq->operands.size(); ++ i) {
+			Syntagma* s = seq->operands[i];
+			s->parent = seq;
+			s->place = i;
+			s->rule = r;
 		}
+		r->right = seq;
+	}
 
-		if (show_it) {
-			std::cout << "TO FLATEN: " << op->show() << std::endl;
-			std::cout << "IN RULE: " << op->rule->show() << std::endl;
+	/// Appends the references, which s reduces to, to out.
+	void lower(Syntagma* s, vector<Syntagma*>& out) {
+		switch (s->kind) {
+		case Syntagma::REF:
+			out.push_back(s);
+			break;
+		case Syntagma::SEQ:
+			for (Syntagma* x : take(static_cast<Seq*>(s))) lower(x, out);
+			break;
+		case Syntagma::ALT: {
+			symb::Nonterm* nt = grammar.fresh_nonterm();
+			for (Syntagma* x : take(static_cast<Alt*>(s))) add(nt, x);
+			out.push_back(new Ref(nt));
+			break;
+		}
+		case Syntagma::ITER: {
+			symb::Nonterm* nt = grammar.fresh_nonterm();
+			iterate(nt, take(static_cast<UnaryOperator*>(s)));
+			out.push_back(new Ref(nt));
+			break;
+		}
+		case Syntagma::OPT: {
+			symb::Nonterm* nt = grammar.fresh_nonterm();
+			add(nt, take(static_cast<UnaryOperator*>(s)));
+			add(nt, new Ref(empty));
+			out.push_back(new Ref(nt));
+			break;
 		}
-*/
-		to_flaten.erase(to_flaten.begin());
-		if (op->flaten(this)) delete op;
-/*
-		if (show_it) {
-			std::cout << "AFTER: " << std::endl << show() << std::endl;
 		}
-*/
 	}
+
+	/// N -> beta N, N -> ""
+	void iterate(Symb* nt, Syntagma* body) {
+		Seq* seq = body->kind == Syntagma::SEQ ? static_cast<Seq*>(body) : new Seq({body});
+		seq->operands.push_back(new Ref(nt));
+		add(nt, seq);
+		add(nt, new Ref(empty));
+	}
+
+	/// The references of s are resolved already, so the rule is not completed again.
+	void add(Symb* nt, Syntagma* s) {
+		s->parent = nullptr;
+		Rule* r = new Rule(new Ref(nt), s);
+		r->id = grammar.rules.size();
+		grammar.rules.push_back(r);
+	}
+
+	/// Detaches the operands of an operator and deletes it.
+	static vector<Syntagma*> take(NaryOperator* op) {
+		vector<Syntagma*> ret;
+		ret.swap(op->operands);
+		delete op;
+		return ret;
+	}
+	static Syntagma* take(UnaryOperator* op) {
+		Syntagma* ret = op->operand;
+		op->operand = nullptr;
+		delete op;
+		return ret;
+	}
+};
+
+}
+
+/// Flattens the rules added since the last call, the rules it makes are appended.
+void Grammar::flaten_ebnf() {
+	rule::Flattener f{*this, symb_map.at("")};
+	for (; flat < rules.size(); ++ flat) f.flatten(rules[flat]);
+	changed();
 }
 
 }
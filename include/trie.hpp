@@ -0,0 +1,624 @@
+#pragma once
+
+#include "syntagma.hpp"
+#include "expr.hpp"
+#include "flat.hpp"
+#include "events.hpp"
+#include "lexer.hpp"
+#include "analysis.hpp"
+
+namespace dynaparse {
+namespace parser {
+
+struct Node;
+
+/**
+ * A level of the trie: alternative nodes, tried in order.
+ * The terminal nodes of a level may share a combined automaton (scanner).
+ */
+struct Tree : public vector<Node> {
+	std::unique_ptr<const Dfa> scanner;
+	// for each character (and Analysis::END) the range [first, last) of nodes,
+	// which may start with it; only for levels of 2..255 nodes
+	std::unique_ptr<uint8_t[]> range;
+	// at most one node may start with any character: none of them matches
+	// nothing and their first sets are disjoint, no alternative is ever backtracked to
+	bool single = false;
+};
+
+struct Node {
+	Tree        next;
+	const Symb* symb;
+	const Rule* rule;
+	union {
+		const Tree* tree;    // NONTERM: the tree of the non-terminal
+		const Dfa*  scanner; // KEYWORD, REGEXP: scanner of the level, if it matches this node
+	};
+	Analysis::Chars first;   // characters which may start a match, all of them if the node may match nothing
+	uint        id;          // id of the symbol
+	short       tag;         // index of the node pattern in the scanner
+	Symb::Kind  kind;
+	bool        final;
+};
+
+vector<string> show_vect(const Node& n);
+
+vector<string> show_vect(const Tree& t) {
+	vector<string> ret;
+	for (const Node& n : t) {
+		vector<string> v = show_vect(n);
+		for (string& s : v) ret.push_back(s);
+	}
+	return ret;
+}
+
+vector<string> show_vect(const Node& n) {
+	vector<string> ret;
+	vector<string> next = show_vect(n.next);
+	if (next.size()) {
+		for (string& s : next) {
+			ret.push_back(n.symb->name + (n.rule ? "[" + n.rule->show() + "]" : "") + " " + s);
+		}
+	} else {
+		ret.push_back(n.symb->name + (n.rule ? "[" + n.rule->show() + "]" : ""));
+	}
+	return ret;
+}
+
+string show(const Node& n) {
+	string ret;
+	vector<string> vect = show_vect(n);
+	for (string& s : vect) {
+		ret += "\t" + s + "\n";
+	}
+	return ret;
+}
+
+string show(const Tree& tree) {
+	string ret;
+	for (const Node& n : tree) {
+		ret += show(n);
+	}
+	return ret;
+}
+
+inline Node createNode(map<string, Tree>& trees, const Symb* s) {
+	Node n;
+	n.symb = s;
+	n.rule = nullptr;
+	n.id = s->id;
+	n.tag = -1;
+	n.kind = s->kind;
+	switch (s->kind) {
+	case Symb::NONTERM:
+		assert(trees.count(s->name) && "non-terminal is not declared");
+		n.tree = &trees.at(s->name);
+		break;
+	default:
+		n.scanner = nullptr;
+	}
+	return n;
+}
+
+/// The symbols of the right side of a flattened rule, as a path in a trie.
+inline vector<Syntagma*> path(const Rule* rule) {
+	if (rule->right->kind == Syntagma::SEQ || rule->right->kind == Syntagma::ALT) {
+		return static_cast<rule::NaryOperator*>(rule->right)->operands;
+	}
+	return {rule->right};
+}
+
+/**
+ * Adds a path to a trie, returns its last node. The levels, which got
+ * a new node, are appended to grown: their scanners are out of date.
+ */
+inline Node* add(map<string, Tree>& trees, Tree& tree, const vector<Syntagma*>& ex, vector<Tree*>* grown = nullptr) {
+	assert(ex.size());
+	Tree* m = &tree;
+	Node* n = nullptr;
+	for (Syntagma* ss : ex) {
+		if (ss->kind != Syntagma::REF) {
+			std::cerr << "syntagma " << ss->show() << " must be a symbol reference" <<std::endl;
+			throw std::exception();
+		}
+		const Symb* symb = static_cast<rule::Ref*>(ss)->ref;
+		bool new_symb = true;
+		for (Node& p : *m) {
+			if (p.id == symb->id) {
+				n = &p;
+				m = &p.next;
+				new_symb = false;
+				break;
+			}
+		}
+		if (new_symb) {
+			if (grown) grown->push_back(m);
+			if (m->size()) m->back().final = false;
+			m->push_back(createNode(trees, symb));
+			n = &m->back();
+			n->final = true;
+			m = &n->next;
+		}
+	}
+	return n;
+}
+
+/**
+ * Removes the path of a rule from a trie: the rule is taken off its last node,
+ * then the nodes, which lead to nothing any more, are erased. Returns the level,
+ * which lost a node (its scanner is out of date), nullptr if there is none.
+ */
+inline Tree* remove(Tree& tree, const Rule* rule, const vector<Syntagma*>& ex) {
+	vector<pair<Tree*, size_t>> nodes; // level and index of each node of the path
+	Tree* m = &tree;
+	for (Syntagma* ss : ex) {
+		const Symb* symb = static_cast<rule::Ref*>(ss)->ref;
+		auto it = std::find_if(m->begin(), m->end(), [symb](const Node& n) { return n.id == symb->id; });
+		if (it == m->end()) return nullptr;
+		nodes.emplace_back(m, it - m->begin());
+		m = &it->next;
+	}
+	if (nodes.empty() || (*nodes.back().first)[nodes.back().second].rule != rule) return nullptr;
+	(*nodes.back().first)[nodes.back().second].rule = nullptr;
+	Tree* shrunk = nullptr;
+	for (auto it = nodes.rbegin(); it != nodes.rend(); ++ it) {
+		Tree& level = *it->first;
+		if (level[it->second].rule || level[it->second].next.size()) break;
+		level.erase(level.begin() + it->second);
+		if (level.size()) level.back().final = true;
+		shrunk = &level;
+	}
+	return shrunk;
+}
+
+/**
+ * Combines the keywords and regexps of a level, if there are at least two
+ * of them, into one automaton, so that all of them are matched in one pass.
+ */
+inline void compile_scanner(Tree& tree) {
+	vector<Dfa::Pattern> patterns;
+	vector<Node*> nodes;
+	for (Node& n : tree) {
+		n.tag = -1;
+		switch (n.kind) {
+		case Symb::KEYWORD:
+			n.scanner = nullptr;
+			patterns.push_back(Dfa::Pattern{n.symb->key(), true});
+			nodes.push_back(&n);
+			break;
+		case Symb::REGEXP:
+			n.scanner = nullptr;
+			if (static_cast<const symb::Regexp*>(n.symb)->dfa.valid()) {
+				patterns.push_back(Dfa::Pattern{n.symb->key(), false});
+				nodes.push_back(&n);
+			}
+			break;
+		default: break;
+		}
+	}
+	tree.scanner.reset();
+	if (nodes.size() < 2) return;
+	tree.scanner.reset(new Dfa(patterns));
+	for (uint i = 0; i < nodes.size(); ++ i) {
+		if (tree.scanner->valid(i)) {
+			nodes[i]->scanner = tree.scanner.get();
+			nodes[i]->tag = i;
+		}
+	}
+}
+
+inline void compile_scanners(Tree& tree) {
+	compile_scanner(tree);
+	for (Node& n : tree) compile_scanners(n.next);
+}
+
+/// Scanners are shared by all parses, so they are built completely beforehand.
+inline void complete_scanners(const Tree& tree) {
+	if (tree.scanner) tree.scanner->complete();
+	for (const Node& n : tree) complete_scanners(n.next);
+}
+
+/**
+ * Computes the lookahead of the nodes of a tree from the FIRST sets of the
+ * symbols. A node, which may match nothing (its symbol is nullable and a rule
+ * ends at it or some path from it is nullable), may start with any character.
+ * Note that after a node, which ends a rule, the rest of the trie is not tried.
+ */
+inline void compile_lookahead(Tree& tree, const Analysis& an) {
+	for (Node& n : tree) {
+		compile_lookahead(n.next, an);
+		n.first = an.first[n.id];
+		if (an.nullable[n.id]) {
+			bool empty = n.rule;
+			if (!n.rule) {
+				for (const Node& m : n.next) {
+					n.first |= m.first;
+					empty |= m.first.all();
+				}
+			}
+			if (empty) n.first.set();
+		}
+	}
+	Analysis::Chars seen;
+	tree.single = true;
+	for (const Node& n : tree) {
+		tree.single &= !n.first.all() && (seen & n.first).none();
+		seen |= n.first;
+	}
+	tree.range.reset();
+	if (tree.size() < 2 || tree.size() > 255) return;
+	tree.range.reset(new uint8_t[2 * (Analysis::END + 1)]);
+	for (uint c = 0; c <= Analysis::END; ++ c) {
+		uint8_t b = tree.size(), e = 0;
+		for (uint i = 0; i < tree.size(); ++ i) {
+			if (tree[i].first[c]) {
+				b = std::min<uint8_t>(b, i);
+				e = i + 1;
+			}
+		}
+		tree.range[2 * c] = std::min(b, e);
+		tree.range[2 * c + 1] = e;
+	}
+}
+
+typedef Tree::const_iterator MapIter;
+
+/**
+ * Input of parse_LL: a position type and the way to skip, to match
+ * terminal nodes and to map positions back to the source text.
+ */
+struct CharInput {
+	typedef StrIter Pos;
+	enum { CACHE_SIZE = 64 };
+	struct Scan {
+		const Dfa*  scanner;
+		Pos         pos;
+		bool        ok;
+		vector<int> lens;
+	};
+	/// A skipped run: every level of a trie skips again at the position, where its siblings did.
+	struct Skip {
+		Pos from;
+		Pos to;
+	};
+	/// The caches are kept by the caller, so that their memory is reused by the next parse.
+	CharInput(StrIter b, StrIter e, const Blanks& bl, vector<Scan>& c, vector<Skip>& s) : origin(b), last(e), blanks(bl), cache(c), skips(s) {
+		cache.resize(CACHE_SIZE);
+		for (Scan& sc : cache) sc.scanner = nullptr;
+		skips.assign(CACHE_SIZE, Skip{nullptr, nullptr});
+	}
+	void skip(Pos& p) const {
+		if (p == last || !blanks.starts(*p)) return;
+		Skip& s = skips[(p - origin) % CACHE_SIZE];
+		if (s.from != p) {
+			s.from = p;
+			blanks.skip(p, last);
+			s.to = p;
+		}
+		p = s.to;
+	}
+	uint peek(Pos p) const { return p == last ? uint(Analysis::END) : static_cast<unsigned char>(*p); }
+	bool match(const Node& n, Pos& p) const {
+		if (n.scanner) {
+			if (const int* lens = scan(*n.scanner, p)) {
+				if (lens[n.tag] < 0) return false;
+				p += lens[n.tag];
+				return true;
+			}
+		}
+		return n.symb->matches(p, last);
+	}
+	/// Scanner results are cached, as siblings are tried at the same position one after another.
+	const int* scan(const Dfa& scanner, Pos p) const {
+		Scan& s = cache[(std::hash<const void*>()(&scanner) ^ (p - origin)) % CACHE_SIZE];
+		if (s.scanner != &scanner || s.pos != p) {
+			s.scanner = &scanner;
+			s.pos = p;
+			s.lens.resize(scanner.size());
+			s.ok = scanner.scan(p, last, s.lens.data());
+		}
+		return s.ok ? s.lens.data() : nullptr;
+	}
+	/// A result of the memo is taken, its parse read the input up to reach.
+	void    touch(size_t) const { }
+	/// The last read ran out of the input, which is there so far (see PushParser): never for a whole source.
+	bool    starved() const { return false; }
+	size_t  offset(Pos p) const { return p - origin; }
+	Pos     at(size_t o) const { return origin + o; }
+	StrIter beg(Pos p) const { return p; }
+	StrIter end(Pos, Pos p) const { return p; }
+
+	StrIter       origin;
+	StrIter       last;
+	const Blanks& blanks;
+	vector<Scan>& cache;
+	vector<Skip>& skips;
+};
+
+/**
+ * Input made of tokens, produced by Lexer. Terminals are matched by
+ * comparing symbols, the empty keyword matches without consuming a token.
+ */
+struct TokenInput {
+	typedef const Token* Pos;
+	TokenInput(const vector<Token>& t, StrIter e, uint eps) :
+		origin(t.data()), last(t.data() + t.size()), text_end(e), epsilon(eps) { }
+	void skip(Pos&) const { }
+	uint peek(Pos p) const { return p == last ? uint(Analysis::END) : static_cast<unsigned char>(*p->beg); }
+	bool match(const Node& n, Pos& p) const {
+		if (n.id == epsilon) return true;
+		if (p == last || p->id != n.id) return false;
+		++p;
+		return true;
+	}
+	void    touch(size_t) const { }
+	bool    starved() const { return false; }
+	size_t  offset(Pos p) const { return p - origin; }
+	Pos     at(size_t o) const { return origin + o; }
+	StrIter beg(Pos p) const { return p == last ? text_end : p->beg; }
+	StrIter end(Pos b, Pos p) const { return p == b ? beg(b) : (p - 1)->end; }
+
+	Pos     origin;
+	Pos     last;
+	StrIter text_end;
+	uint    epsilon;
+};
+
+/**
+ * Packrat memo table: keeps the outcome of parsing a non-terminal tree
+ * at a given input offset. Successful results are shared with the
+ * parse tree (see Expr::share), failures are stored as nullptr.
+ * When the estimated size of the table exceeds the limit, new
+ * outcomes are not stored any more.
+ */
+struct Memo {
+	struct Entry {
+		size_t end;
+		Expr*  expr;
+		size_t reach; // one past the last char the parse read (see IncrementalParser)
+	};
+	typedef pair<const void*, size_t> Key; // a trie (or its code) and an offset
+	struct Hash {
+		size_t operator()(const Key& k) const {
+			return std::hash<const void*>()(k.first) ^ (k.second * 0x9e3779b97f4a7c15ull);
+		}
+	};
+	enum { ENTRY_SIZE = sizeof(pair<const Key, Entry>) + 2 * sizeof(void*) };
+
+	Memo(size_t lim, ExprArena* a = nullptr) : limit(lim), arena(a), table() { }
+	~ Memo() {
+		if (arena) return;
+		for (auto& p : table) if (p.second.expr) release(p.second.expr);
+	}
+	const Entry* find(const void* tree, size_t pos) const {
+		auto it = table.find(Key(tree, pos));
+		return it == table.end() ? nullptr : &it->second;
+	}
+	void store(const void* tree, size_t pos, size_t end, Expr* ex) {
+		if ((table.size() + 1) * ENTRY_SIZE > limit) return;
+		Entry& e = table[Key(tree, pos)];
+		e.end = end;
+		e.expr = ex && !arena ? ex->share() : ex;
+		e.reach = end;
+	}
+	/// Adds a known result, whatever the limit; an entry at the same key is kept.
+	void seed(const void* tree, size_t pos, size_t end, size_t reach, Expr* ex) {
+		table.emplace(Key(tree, pos), Entry{end, ex && !arena ? ex->share() : ex, reach});
+	}
+
+	size_t     limit;
+	ExprArena* arena;
+	unordered_map<Key, Entry, Hash> table;
+};
+
+/**
+ * What a parse allocates with: the memo table (optional) and the arena for
+ * the expressions (heap is used without it). In an arena the nodes of a
+ * failed branch are dropped by rolling the arena back, unless the memo
+ * table may still refer to them. With events or a flat tree (bytecode
+ * only, no memo) no expressions are built at all.
+ */
+struct Context {
+	Memo*              memo;
+	ExprArena*         arena;
+	Events*            events;
+	FlatTree::Builder* flat;
+
+	/// The state to roll back to: of the arena, or the nodes done of a flat tree.
+	ExprArena::Mark mark() const { return arena ? arena->mark() : ExprArena::Mark{0, flat ? flat->done.size() : 0}; }
+	void drop(vector<Expr*>& children, ExprArena::Mark m) const {
+		if (!arena) release(children.back());
+		else if (!memo) arena->rollback(m);
+		children.pop_back();
+	}
+};
+
+template<class Pos>
+struct Frame {
+	MapIter node; // the node being tried
+	MapIter end;  // the end of the range of nodes to try at this level
+	Pos     pos;  // position of the level
+	ExprArena::Mark mark; // arena state before the child, which led to this level
+};
+
+/// A non-terminal being parsed: its levels are on the frame stack, its children on the children stack.
+template<class Pos>
+struct Call {
+	const Tree*     tree;
+	Pos             beg;
+	size_t          frames;   // the frames of the callers are below
+	size_t          children; // the children of the callers are below
+	ExprArena::Mark mark;     // arena state before the call
+};
+
+/// The stacks of the engine, they keep their memory from one parse to the other.
+template<class Pos>
+struct Stacks {
+	vector<Frame<Pos>> frames;
+	vector<Call<Pos>>  calls;
+	vector<Expr*>      children;
+};
+
+/**
+ * Pushes a level of a trie, narrowed to the nodes which may start at pos.
+ * Returns false when there are no such nodes.
+ */
+template<class Input>
+bool enter(const Input& in, vector<Frame<typename Input::Pos>>& frames, const Tree& level, typename Input::Pos pos, ExprArena::Mark mark) {
+	in.skip(pos);
+	MapIter b = level.begin();
+	MapIter e = level.end();
+	if (level.range) {
+		uint c = in.peek(pos);
+		e = b + level.range[2 * c + 1];
+		b = b + level.range[2 * c];
+	}
+	if (b == e) return false;
+	frames.push_back(Frame<typename Input::Pos>{b, e, pos, mark});
+	return true;
+}
+
+/**
+ * Starts parsing a non-terminal at pos. Returns false when the outcome is known
+ * at once (the left recursion guard, the memo table, no viable node), it is
+ * in ret and end then. Otherwise a call is pushed.
+ */
+template<class Input>
+bool call(const Input& in, Stacks<typename Input::Pos>& st, const Context& ctx, const Tree& tree,
+		typename Input::Pos pos, bool initial, ExprArena::Mark mark, Expr*& ret, typename Input::Pos& end) {
+	ret = nullptr;
+	if (initial || !tree.size()) return false;
+	in.skip(pos);
+	if (ctx.memo) {
+		if (const Memo::Entry* e = ctx.memo->find(&tree, in.offset(pos))) {
+			if (e->expr) {
+				ret = ctx.arena ? e->expr : e->expr->share();
+				end = in.at(e->end);
+				in.touch(e->reach);
+			}
+			return false;
+		}
+	}
+	st.calls.push_back(Call<typename Input::Pos>{&tree, pos, st.frames.size(), st.children.size(), mark});
+	if (enter(in, st.frames, tree, pos, mark)) return true;
+	st.calls.pop_back();
+	if (ctx.memo) ctx.memo->store(&tree, in.offset(pos), in.offset(pos), nullptr);
+	return false;
+}
+
+/**
+ * The engine: tries the nodes of the tries depth first, with backtracking.
+ * Non-terminals are not parsed by recursion: their calls, levels and children
+ * are kept on explicit stacks, so nesting of the input is limited by memory only.
+ */
+template<class Input>
+Expr* parse_LL(const Input& in, typename Input::Pos& beg, const Tree& root, const Context& ctx, Stacks<typename Input::Pos>& st) {
+	typedef typename Input::Pos Pos;
+	st.frames.clear();
+	st.calls.clear();
+	st.children.clear();
+	Expr* ret = nullptr; // outcome of the last finished call
+	Pos   end = beg;
+	if (!call(in, st, ctx, root, beg, false, ctx.mark(), ret, end)) {
+		if (ret) beg = end;
+		return ret;
+	}
+	bool returned = false; // a call has just finished, its caller goes on
+	ExprArena::Mark returned_mark = ctx.mark();
+	// pops the finished call on the top, its outcome is in ret and end
+	auto finish = [&]() {
+		const Call<Pos>& c = st.calls.back();
+		st.frames.resize(c.frames);
+		st.children.resize(c.children);
+		if (ctx.memo) ctx.memo->store(c.tree, in.offset(c.beg), in.offset(ret ? end : c.beg), ret);
+		returned_mark = c.mark;
+		st.calls.pop_back();
+		returned = true;
+	};
+	while (true) {
+		bool matched = false;
+		Pos ch;
+		ExprArena::Mark mark;
+		if (returned) {
+			returned = false;
+			mark = returned_mark;
+			ch = end;
+			if (ret) {
+				st.children.push_back(ret);
+				matched = true;
+			}
+		} else {
+			const Frame<Pos>& top = st.frames.back();
+			const Node& node = *top.node;
+			ch = top.pos;
+			mark = ctx.mark();
+			if (!node.first[in.peek(ch)]) {
+				// the node can't start here
+			} else if (node.kind == Symb::NONTERM) {
+				const Tree* deeper = node.tree;
+				bool initial = top.node == st.calls.back().tree->begin() && deeper->size() &&
+					deeper->begin()->kind == Symb::NONTERM && deeper->begin()->tree == deeper;
+				if (call(in, st, ctx, *deeper, ch, initial, mark, ret, end)) continue;
+				if (ret) {
+					st.children.push_back(ret);
+					ch = end;
+					matched = true;
+				}
+			} else {
+				Pos c = ch;
+				if (in.match(node, ch)) {
+					st.children.push_back(create<expr::Lexeme>(ctx.arena, in.beg(c), in.end(c, ch)));
+					matched = true;
+				}
+			}
+		}
+		if (matched) {
+			const Node& node = *st.frames.back().node;
+			if (node.rule) {
+				const Call<Pos>& c = st.calls.back();
+				ExprSpan children(st.children.data() + c.children, st.children.size() - c.children);
+				ret = create<expr::Seq>(ctx.arena, in.beg(c.beg), in.end(c.beg, ch), node.rule, children, ctx.arena);
+				end = ch;
+				finish();
+				if (st.calls.empty()) {
+					beg = end;
+					return ret;
+				}
+				continue;
+			}
+			if (enter(in, st.frames, node.next, ch, mark)) continue;
+			ctx.drop(st.children, mark);
+		}
+		// Every level above the first one of a call was entered by matching a node,
+		// so leaving a level drops the child of that node.
+		bool failed = false;
+		while (st.frames.back().node + 1 == st.frames.back().end) {
+			ExprArena::Mark m = st.frames.back().mark;
+			st.frames.pop_back();
+			if (st.frames.size() == st.calls.back().frames) {
+				failed = true;
+				break;
+			}
+			ctx.drop(st.children, m);
+		}
+		if (failed) {
+			ret = nullptr;
+			finish();
+			if (st.calls.empty()) return nullptr;
+			continue;
+		}
+		++ st.frames.back().node;
+	}
+}
+
+inline Expr* parse_LL(StrIter& beg, StrIter end, Skipper* skipper, const Tree& tree, Memo* memo = nullptr) {
+	Blanks blanks(skipper);
+	vector<CharInput::Scan> cache;
+	vector<CharInput::Skip> skips;
+	Stacks<StrIter> st;
+	return parse_LL(CharInput(beg, end, blanks, cache, skips), beg, tree, Context{memo, nullptr, nullptr, nullptr}, st);
+}
+
+} // parser namespace
+
+}
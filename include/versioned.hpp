@@ -0,0 +1,54 @@
+#pragma once
+
+#include "parser.hpp"
+
+namespace dynaparse {
+
+/**
+ * A grammar, which changes while it is being used for parsing (read-copy-update).
+ * Each version is a grammar together with its parser and is immutable once
+ * published. A parse pins the current version by taking a snapshot, so a
+ * writer never waits for readers: it changes a copy of the grammar, builds
+ * a parser for it and publishes it atomically. A version is freed when the
+ * last snapshot of it is dropped.
+ *
+ * Parse trees refer to the rules of the version, which built them, so the
+ * snapshot must be kept as long as the trees are used.
+ */
+class VersionedParser {
+public:
+	struct Version {
+		Version(std::unique_ptr<Grammar> gr, uint n) : grammar(std::move(gr)), parser(*grammar), number(n) { }
+		std::unique_ptr<Grammar> grammar;
+		Parser                   parser;
+		uint                     number;
+	};
+	typedef std::shared_ptr<const Version> Snapshot;
+
+	/// The grammar is copied, it must be flattened.
+	VersionedParser(const Grammar& gr) : current(std::make_shared<const Version>(std::unique_ptr<Grammar>(gr.clone()), 0)), writer() { }
+
+	Snapshot snapshot() const { return std::atomic_load(&current); }
+
+	/**
+	 * Applies change (a callable taking Grammar&) to a copy of the current grammar,
+	 * then publishes the new version. Writers are serialized with each other only.
+	 */
+	template<class Change>
+	Snapshot update(Change change) {
+		std::lock_guard<std::mutex> lock(writer);
+		Snapshot last = snapshot();
+		std::unique_ptr<Grammar> gr(last->grammar->clone());
+		change(*gr);
+		gr->flaten_ebnf();
+		Snapshot next = std::make_shared<const Version>(std::move(gr), last->number + 1);
+		std::atomic_store(&current, next);
+		return next;
+	}
+
+private:
+	Snapshot   current;
+	std::mutex writer;
+};
+
+}
@@ -0,0 +1,430 @@
+#pragma once
+
+#include "trie.hpp"
+
+namespace dynaparse {
+namespace vm {
+
+/**
+ * Bytecode of the tries, in the style of LPeg. Every level of a trie is
+ * a chain of alternatives: CHOICE pushes a backtrack entry for the next one,
+ * FAIL pops the entries back to the last choice. A non-terminal is a CALL
+ * of the code of its trie, ACCEPT builds the node of a rule and returns.
+ * The alternatives of a level are tried in the order of the trie nodes,
+ * so the bytecode parses exactly as the tries do. A single level (see
+ * parser::Tree) has no choices: when its alternative fails, the others can't
+ * start there. COMMIT drops the choices of the levels on a path, once
+ * the rest of it can't fail (see sure): their next alternatives would never
+ * be tried anyway.
+ */
+enum Op : uint8_t {
+	SKIP,     // skips blanks
+	DISPATCH, // jumps by the next character, arg is a table of Program::dispatch
+	CHOICE,   // pushes a backtrack entry to arg
+	TEST,     // jumps to alt unless the next character is in the set arg
+	MATCH,    // matches the terminal node arg, alt is its symbol id
+	CALL,     // parses the non-terminal arg, alt is its symbol id
+	ACCEPT,   // the rule arg is matched: builds its node, returns
+	FAIL,
+	HALT,     // the start non-terminal is parsed
+	COMMIT    // pops arg choices, of the levels on the path
+};
+
+struct Instr {
+	Op   op;
+	uint arg;
+	uint alt;
+};
+
+typedef std::set<const parser::Tree*> Trees;
+
+/**
+ * The tables of the machine. run() reads them through the accessors below,
+ * so it also runs the same code mapped from a file (see Image). After
+ * an update the tables keep the dead code of the recompiled tries too,
+ * its terminals and rules may be gone: only the code reaches into them.
+ */
+struct Program {
+	enum { FAIL_PC = 0, HALT_PC = 1, TABLE = Analysis::END + 1 };
+
+	vector<Instr>                   code;
+	vector<uint>                    entries;   // code of the trie of each non-terminal
+	vector<const parser::Tree*>     trees;     // the tries, memo keys
+	map<const parser::Tree*, uint>  index;     // non-terminal of a trie
+	vector<Analysis::Chars>         sets;
+	vector<const parser::Node*>     terminals;
+	vector<const Rule*>             rules;
+	vector<uint>                    dispatch;  // tables of TABLE targets
+	Trees                           succeed;   // the tries, which can't fail
+	unordered_map<Analysis::Chars, uint> set_ids; // index of each set
+	size_t                          compiled;  // the size of the code, when all of it was compiled
+
+	const Instr* instrs() const { return code.data(); }
+	uint entry(uint tree) const { return entries[tree]; }
+	bool test(uint set, uint c) const { return sets[set][c]; }
+	uint jump(uint table, uint c) const { return dispatch[table * TABLE + c]; }
+	const void* key(uint tree) const { return trees[tree]; }
+	template<class Input>
+	bool match(const Input& in, uint terminal, typename Input::Pos& pos) const { return in.match(*terminals[terminal], pos); }
+	Expr* accept(ExprArena* arena, StrIter b, StrIter e, uint rule, ExprSpan kids) const {
+		return create<expr::Seq>(arena, b, e, rules[rule], kids, arena);
+	}
+	uint rule_id(uint rule) const { return rules[rule]->id; }
+};
+
+inline uint emit(Program& p, Op op, uint arg = 0, uint alt = 0) {
+	p.code.push_back(Instr{op, arg, alt});
+	return p.code.size() - 1;
+}
+
+inline bool initial(const parser::Node& n, const parser::Tree& root) {
+	return &n == &root.front() && n.tree->size() && n.tree->front().kind == Symb::NONTERM && n.tree->front().tree == n.tree;
+}
+
+/// Whatever follows, a node matches: it has no lookahead and is the empty keyword or a non-terminal, which can't fail.
+inline bool sure(const parser::Node& n, const parser::Tree& root, const Trees& succeed) {
+	if (!n.first.all()) return false;
+	if (n.kind == Symb::KEYWORD) return n.symb->key().empty();
+	return n.kind == Symb::NONTERM && succeed.count(n.tree) && !initial(n, root);
+}
+
+/// A level can't fail, if one of its paths can't: the alternatives are tried up to it.
+inline bool sure(const parser::Tree& level, const parser::Tree& root, const Trees& succeed) {
+	for (const parser::Node& n : level) {
+		if (sure(n, root, succeed) && (n.rule || sure(n.next, root, succeed))) return true;
+	}
+	return false;
+}
+
+/// Compiles a level, open choices of the levels above on the path are still on the stack.
+inline void compile(Program& p, const parser::Tree& level, const parser::Tree& root, uint open = 0) {
+	emit(p, SKIP);
+	uint table = uint(-1);
+	if (level.range) {
+		table = p.dispatch.size();
+		p.dispatch.resize(table + Program::TABLE);
+		emit(p, DISPATCH, table / Program::TABLE);
+	}
+	vector<uint> starts;
+	vector<uint> jumps; // instructions to patch with the start of the next alternative
+	for (uint i = 0; i < level.size(); ++ i) {
+		const parser::Node& n = level[i];
+		starts.push_back(p.code.size());
+		for (uint j : jumps) {
+			if (p.code[j].op == CHOICE) p.code[j].arg = starts.back();
+			else p.code[j].alt = starts.back();
+		}
+		jumps.clear();
+		// on a single level the next alternatives can't start where this one does
+		bool last = i + 1 == level.size() || level.single;
+		if (!n.first.all()) {
+			auto it = p.set_ids.emplace(n.first, p.sets.size()).first;
+			if (it->second == p.sets.size()) p.sets.push_back(n.first);
+			uint test = emit(p, TEST, it->second, Program::FAIL_PC);
+			if (!last) jumps.push_back(test);
+		}
+		if (!last) jumps.push_back(emit(p, CHOICE));
+		if (n.kind == Symb::NONTERM) {
+			if (initial(n, root) || !n.tree->size()) emit(p, FAIL);
+			else emit(p, CALL, p.index.at(n.tree), n.id);
+		} else {
+			emit(p, MATCH, p.terminals.size(), n.id);
+			p.terminals.push_back(&n);
+		}
+		if (n.rule) {
+			emit(p, ACCEPT, p.rules.size());
+			p.rules.push_back(n.rule);
+		} else if (n.next.empty()) {
+			emit(p, FAIL);
+		} else {
+			uint choices = open + !last;
+			if (choices && sure(n.next, root, p.succeed)) {
+				emit(p, COMMIT, choices);
+				choices = 0;
+			}
+			compile(p, n.next, root, choices);
+		}
+	}
+	if (table == uint(-1)) return;
+	for (uint c = 0; c < Program::TABLE; ++ c) {
+		uint b = level.range[2 * c], e = level.range[2 * c + 1];
+		p.dispatch[table + c] = b < e ? starts[b] : uint(Program::FAIL_PC);
+	}
+}
+
+/// The tries, which can't fail.
+inline Trees succeeding(const vector<const parser::Tree*>& trees) {
+	Trees ret;
+	for (bool grown = true; grown; ) {
+		grown = false;
+		for (const parser::Tree* t : trees) {
+			if (!ret.count(t) && sure(*t, *t, ret)) grown = ret.insert(t).second;
+		}
+	}
+	return ret;
+}
+
+/// Appends the code of a trie, its entry moves there.
+inline void compile(Program& p, const parser::Tree& t) {
+	p.entries[p.index.at(&t)] = p.code.size();
+	if (t.size()) compile(p, t, t);
+	else emit(p, FAIL);
+}
+
+/// Lowers the tries of all non-terminals into one program.
+inline void compile(Program& p, const map<string, parser::Tree>& trees) {
+	p = Program();
+	emit(p, FAIL);
+	emit(p, HALT);
+	for (auto& t : trees) {
+		p.index[&t.second] = p.trees.size();
+		p.trees.push_back(&t.second);
+	}
+	p.succeed = succeeding(p.trees);
+	p.entries.resize(p.trees.size());
+	for (const parser::Tree* t : p.trees) compile(p, *t);
+	p.compiled = p.code.size();
+}
+
+/**
+ * Recompiles the changed tries and adds the new ones, the code of the others
+ * stays. The changed ones must include the callers of a trie, whose first node
+ * or emptiness changed (see initial). When the tries, which can't fail, change
+ * or the dead code outgrows the live one, all of the program is compiled anew.
+ */
+inline void update(Program& p, const map<string, parser::Tree>& trees, Trees changed) {
+	for (auto& t : trees) {
+		if (p.index.count(&t.second)) continue;
+		p.index[&t.second] = p.trees.size();
+		p.trees.push_back(&t.second);
+		p.entries.push_back(0);
+		changed.insert(&t.second);
+	}
+	if (succeeding(p.trees) != p.succeed || p.code.size() > 2 * p.compiled) {
+		compile(p, trees);
+		return;
+	}
+	for (const parser::Tree* t : changed) compile(p, *t);
+}
+
+/// A backtrack entry (a choice) or a call of a non-terminal.
+template<class Pos>
+struct Entry {
+	enum { CHOICE = uint(-1) };
+	uint            pc;       // CHOICE: the next alternative, call: the return address
+	uint            tree;     // CHOICE or the non-terminal
+	size_t          children; // number of children (or pending events) before
+	size_t          caller;   // call: the entry of the caller, CHOICE: the choice below (see run)
+	Pos             pos;
+	ExprArena::Mark mark;
+};
+
+/// The registers of a run, which waits for more input.
+template<class Pos>
+struct Resume {
+	uint   pc;
+	size_t caller;
+	size_t choice;
+	Pos    pos;
+	Pos    first;
+};
+
+/// The stacks of the machine, they keep their memory from one parse to the other.
+template<class Pos>
+struct Stack {
+	Stack() : entries(), children(), suspended(false), resume() { }
+	vector<Entry<Pos>> entries;
+	vector<Expr*>      children;
+	bool               suspended; // the run goes on from resume, when it is called again
+	Resume<Pos>        resume;
+};
+
+/**
+ * Runs a program from the trie of the non-terminal tree. Dispatch is direct
+ * threaded: each instruction jumps to the handler of the next one.
+ *
+ * With ctx.events the machine builds no nodes: it records events and hands
+ * them over, whenever no choice is left on the stack (choice is the top one,
+ * counted from 1). Packrat memo is not used then. The result of a successful
+ * parse is the span of the events. With ctx.flat the machine builds the nodes
+ * of a flat tree instead of expressions (see FlatTree::Builder), without memo
+ * too; the result is the span of the tree.
+ *
+ * When an instruction would read past the input, which is there so far
+ * (see Input::starved), the run is suspended: it returns nullptr with
+ * st.suspended set, the next call with the same stack and more input
+ * goes on with that instruction.
+ */
+template<class Input, class Code>
+Expr* run(const Code& p, uint tree, const Input& in, typename Input::Pos& beg, const parser::Context& ctx, Stack<typename Input::Pos>& st) {
+	typedef typename Input::Pos Pos;
+	static const void* handlers[] = {&&skip, &&dispatch, &&choice, &&test, &&match, &&call, &&accept, &&fail, &&halt, &&commit};
+	const Instr* code = p.instrs();
+	if (code[p.entry(tree)].op == FAIL) return nullptr; // no rules
+	vector<Entry<Pos>>& entries = st.entries;
+	vector<Expr*>& children = st.children;
+	Events* events = ctx.events;
+	FlatTree::Builder* flat = ctx.flat;
+	const parser::Memo* memo = events || flat ? nullptr : ctx.memo;
+	// the children (or pending events, or flat nodes) on the stack
+	auto stacked = [&]() { return events ? events->pending.size() : flat ? flat->open.size() : children.size(); };
+	Pos pos = beg;
+	Pos first = pos;
+	size_t caller = 0;
+	size_t choice = 0;
+	uint pc = p.entry(tree);
+	if (st.suspended) {
+		const Resume<Pos>& r = st.resume;
+		st.suspended = false;
+		pc = r.pc;
+		caller = r.caller;
+		choice = r.choice;
+		pos = r.pos;
+		first = r.first;
+	} else {
+		entries.clear();
+		children.clear();
+		if (flat) flat->clear();
+		in.skip(pos);
+		first = pos;
+		entries.push_back(Entry<Pos>{Program::HALT_PC, tree, stacked(), 0, pos, ctx.mark()});
+	}
+
+#define NEXT goto *handlers[code[pc].op]
+	NEXT;
+skip:
+	in.skip(pos);
+	if (in.starved()) goto suspend;
+	++ pc;
+	NEXT;
+dispatch: {
+	uint c = in.peek(pos);
+	if (in.starved()) goto suspend;
+	pc = p.jump(code[pc].arg, c);
+	NEXT;
+}
+choice:
+	entries.push_back(Entry<Pos>{code[pc].arg, Entry<Pos>::CHOICE, stacked(), choice, pos, ctx.mark()});
+	choice = entries.size();
+	++ pc;
+	NEXT;
+commit:
+	for (uint i = 0; i < code[pc].arg; ++ i) {
+		choice = entries.back().caller;
+		entries.pop_back();
+	}
+	if (events && !choice) events->flush();
+	++ pc;
+	NEXT;
+test: {
+	uint c = in.peek(pos);
+	if (in.starved()) goto suspend;
+	pc = p.test(code[pc].arg, c) ? pc + 1 : code[pc].alt;
+	NEXT;
+}
+match: {
+	Pos b = pos;
+	if (!p.match(in, code[pc].arg, pos)) {
+		if (in.starved()) goto suspend;
+		goto fail;
+	}
+	if (events) events->pending.push_back(Event{Event::TOKEN, code[pc].alt, in.offset(b), in.offset(pos)});
+	else if (flat) flat->lexeme(in.offset(b), in.offset(pos));
+	else children.push_back(create<expr::Lexeme>(ctx.arena, in.beg(b), in.end(b, pos)));
+	++ pc;
+	NEXT;
+}
+call: {
+	uint t = code[pc].arg;
+	if (events) events->pending.push_back(Event{Event::ENTER, code[pc].alt, in.offset(pos), in.offset(pos)});
+	if (memo) {
+		if (const parser::Memo::Entry* e = memo->find(p.key(t), in.offset(pos))) {
+			if (!e->expr) goto fail;
+			in.touch(e->reach);
+			children.push_back(ctx.arena ? e->expr : e->expr->share());
+			pos = in.at(e->end);
+			++ pc;
+			NEXT;
+		}
+	}
+	entries.push_back(Entry<Pos>{pc + 1, t, stacked(), caller, pos, ctx.mark()});
+	caller = entries.size() - 1;
+	pc = p.entry(t);
+	NEXT;
+}
+accept: {
+	const Entry<Pos>& c = entries[caller];
+	if (events) {
+		events->pending.push_back(Event{Event::EXIT, p.rule_id(code[pc].arg), in.offset(c.pos), in.offset(pos)});
+	} else if (flat) {
+		flat->accept(p.rule_id(code[pc].arg), in.offset(c.pos), in.offset(pos), c.children);
+	} else {
+		ExprSpan kids(children.data() + c.children, children.size() - c.children);
+		Expr* ex = p.accept(ctx.arena, in.beg(c.pos), in.end(c.pos, pos), code[pc].arg, kids);
+		children.resize(c.children);
+		children.push_back(ex);
+		if (memo) ctx.memo->store(p.key(c.tree), in.offset(c.pos), in.offset(pos), ex);
+	}
+	pc = c.pc;
+	size_t up = c.caller;
+	while (choice > caller) choice = entries[choice - 1].caller; // the choices of the callee are dropped
+	entries.resize(caller);
+	caller = up;
+	if (events && !choice) events->flush();
+	NEXT;
+}
+fail:
+	while (!entries.empty()) {
+		Entry<Pos> e = entries.back();
+		entries.pop_back();
+		if (e.tree == Entry<Pos>::CHOICE) {
+			if (events) {
+				events->pending.resize(e.children);
+			} else if (flat) {
+				flat->rollback(e.children, e.mark.used);
+			} else {
+				if (!ctx.arena) {
+					for (size_t i = e.children; i < children.size(); ++ i) release(children[i]);
+				} else if (!memo) {
+					ctx.arena->rollback(e.mark);
+				}
+				children.resize(e.children);
+			}
+			choice = e.caller;
+			pos = e.pos;
+			pc = e.pc;
+			NEXT;
+		}
+		if (memo) ctx.memo->store(p.key(e.tree), in.offset(e.pos), in.offset(e.pos), nullptr);
+		caller = e.caller;
+	}
+	if (events) events->pending.clear();
+	else if (flat) flat->clear();
+	else if (!ctx.arena) {
+		for (Expr* ex : children) release(ex);
+	}
+	return nullptr;
+halt:
+	if (events) {
+		events->flush();
+		events->span.beg = in.beg(first);
+		events->span.end = in.end(first, pos);
+		beg = pos;
+		return &events->span;
+	}
+	beg = pos;
+	if (flat) {
+		flat->span.beg = in.beg(first);
+		flat->span.end = in.end(first, pos);
+		return &flat->span;
+	}
+	return children.back();
+suspend:
+	st.suspended = true;
+	st.resume = Resume<Pos>{pc, caller, choice, pos, first};
+	return nullptr;
+#undef NEXT
+}
+
+} // namespace vm
+}
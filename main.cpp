@@ -1,4 +1,18 @@
 #include "parser.hpp"
+#include "versioned.hpp"
+#include "codegen.hpp"
+#include "image.hpp"
+#include "optimize.hpp"
+#include "serialize.hpp"
+#include "cache.hpp"
+#include "incremental.hpp"
+#include "push.hpp"
+#include "parallel.hpp"
+#include "expr_parser.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <random>
 
 using namespace dynaparse;
 
@@ -46,10 +60,33 @@ void oberon_grammar(Grammar& gr) {
 	<< Rule(R("VarDecl"), Seq({R("IdentList"), R(":"), R("Type")}));
 }
 
-bool make_test(Parser& p, const string& s, const string& nt, bool expected = true) {
+/// Statements and arithmetic expressions, src/expr_parser.hpp is generated from it.
+void expr_grammar(Grammar& gr) {
+	gr
+	<< Nonterms({"S", "E", "T", "F", "L"}) << Keywords({"+", "*", "(", ")", ";", "=", "let"})
+	<< Regexp("id", "[a-z]+") << Regexp("num", "[0-9]+")
+	<< Rule(R("S"), Iter({Alt({R("L"), R("E")}), R(";")}))
+	<< Rule(R("L"), Seq({R("let"), R("id"), R("="), R("E")}))
+	<< Rule(R("E"), Seq({R("T"), Iter({R("+"), R("T")})}))
+	<< Rule(R("T"), Seq({R("F"), Iter({R("*"), R("F")})}))
+	<< Rule(R("F"), Alt({R("num"), R("id"), Seq({R("("), R("E"), R(")")})}));
+	gr.flaten_ebnf();
+}
+
+/// Sums of identifiers, in parentheses too unless parens is false: the grammar of the tests of the parse outputs.
+void sum_grammar(Grammar& gr, bool parens = true) {
+	gr
+	<< Nonterms({"E", "T"}) << Keywords({"+", "(", ")"}) << Regexp("id", "[a-z]+")
+	<< Rule(R("E"), Seq({R("T"), Iter({R("+"), R("T")})}));
+	if (parens) gr << Rule(R("T"), Seq({R("("), R("E"), R(")")}));
+	gr << Rule(R("T"), Seq({R("id")}));
+	gr.flaten_ebnf();
+}
+
+bool make_test(Parser& p, const string& s, const string& nt, bool expected = true, bool packrat = false) {
 	string str = s;
 	std::cout << "trying to parse: " << str << " ... ";
-	if (Expr* ex = p.parse(str, nt)) {
+	if (Expr* ex = p.parse(str, nt, packrat)) {
 		std::cout << "expr: " << *ex << " - " << (expected ? "OK" : "FAIL") << std::endl;
 		delete ex;
 		return expected;
@@ -126,6 +163,1000 @@ bool test_3() {
 	return ret;
 }
 
+bool test_packrat() {
+	Grammar gr("test_packrat");
+	gr
+	<< Nonterms({"A", "B"}) << Keywords({"a", "ab", "c", "x", "y", "(", ")"})
+	<< Rule(R("A"), Seq({R("a"), R("c")}))
+	<< Rule(R("A"), Seq({R("ab")}))
+	<< Rule(R("A"), Seq({R("B"), R("x")}))
+	<< Rule(R("A"), Seq({R("B"), R("y")}))
+	<< Rule(R("B"), Seq({R("("), R("B"), R(")")}))
+	<< Rule(R("B"), Seq({R("c")}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	bool ret = true;
+	for (bool packrat : {false, true}) {
+		ret &= make_test(p, "ab", "A", true, packrat);
+		ret &= make_test(p, "ac", "A", true, packrat);
+		ret &= make_test(p, "((c)) y", "A", true, packrat);
+		ret &= make_test(p, "((c) y", "A", false, packrat);
+	}
+	string str = "ab";
+	if (Expr* ex = p.parse(str, "A")) {
+		ret &= dynamic_cast<expr::Seq*>(ex)->nodes.size() == 1;
+		delete ex;
+	}
+	return ret;
+}
+
+bool test_tokens() {
+	Grammar gr("test_tokens");
+	gr
+	<< Nonterms({"exp", "block"})
+	<< Keywords({"(", "+", ")", "*", "BEGIN", "END"})
+	<< Regexp("id", "[a-zA-Z]+")
+
+	<< Rule(R("exp"), Seq({R("("), R("exp"), R("+"), R("exp"), R(")")}))
+	<< Rule(R("exp"), Seq({R("("), R("exp"), R("*"), R("exp"), R(")")}))
+	<< Rule(R("exp"), Seq({R("id")}))
+	<< Rule(R("block"), Seq({R("BEGIN"), Iter(R("exp")), R("END")}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	bool ret = true;
+	vector<pair<string, string>> cases = {
+		{"exp", " ((  a * (xyx + bcd)) +    ( b*a))   "},
+		{"exp", "(a + (b*c)"},
+		{"exp", "(a + ?)"}
+	};
+	for (auto& c : cases) {
+		for (bool packrat : {false, true}) {
+			Expr* e1 = p.parse(c.second, c.first, packrat);
+			Expr* e2 = p.parse_tokens(c.second, c.first, packrat);
+			std::cout << "tokens: " << c.second << " ... " << (e2 ? e2->show() : "null") << std::endl;
+			ret &= (!e1 && !e2) || (e1 && e2 && e1->show() == e2->show());
+			if (e1) delete e1;
+			if (e2) delete e2;
+		}
+	}
+	// keywords take priority over regexps of the same length, so END is not an id
+	string block = "BEGIN (a + b) BEGINNER ENDING END";
+	if (Expr* ex = p.parse_tokens(block, "block")) {
+		std::cout << "tokens: " << block << " ... " << *ex << std::endl;
+		delete ex;
+	} else {
+		ret = false;
+	}
+	return ret;
+}
+
+bool test_dfa() {
+	vector<string> patterns = {
+		"[a-zA-Z]+", "[a-zA-Z_][a-zA-Z0-9_]*", "\\d+(\\.\\d+)?([eE][-+]?\\d+)?", "\"([^\"\\\\]|\\\\.)*\"",
+		"0x[0-9a-fA-F]{1,4}", "(?:ab|cd)*e?", "a*", "[^ \\t]+", "x{2,}y",
+		// the first match is not the longest one
+		"a|ab", "(a|ab)(c|bcd)", "a*(ab)?", "(a|ab)*c?", "(|a)b?", "x?(xy)?", "(\\w|\\w\\d)+"
+	};
+	vector<string> inputs = {
+		"abc1", "_x9 y", "3.14e-2z", "12.", "\"a\\\"b\" c", "0x1234567", "ababcde", "", "b",
+		"xxxy", "xy", "\tq", "ab", "abcd", "aab", "abab", "a1b2"
+	};
+	bool ret = true;
+	for (const string& pat : patterns) {
+		Dfa dfa(pat);
+		regex re(pat);
+		ret &= dfa.valid();
+		for (const string& in : inputs) {
+			std::smatch m;
+			int expected = std::regex_search(in.begin(), in.end(), m, re, std::regex_constants::match_continuous) ? m.length() : -1;
+			if (dfa.match(in.begin(), in.end()) != expected) {
+				std::cout << "dfa mismatch: " << pat << " on " << in << std::endl;
+				ret = false;
+			}
+		}
+	}
+	for (const char* pat : {"^a", "a*?", "(?=a)", "\\bx", "(a)\\1", "a{\xE9}", "\\x\xE9\xE9"}) {
+		ret &= !Dfa(pat).valid();
+	}
+	// the first alternative and the greedy quantifier win, as with std::regex
+	string ab = "ab";
+	ret &= Dfa("a|ab").match(ab.begin(), ab.end()) == 1;
+	ret &= Dfa("ab|a").match(ab.begin(), ab.end()) == 2;
+	// the patterns of a scanner do not cut each other
+	int lens[2];
+	ret &= Dfa(vector<Dfa::Pattern>{{"a|ab", false}, {"ab", true}}).scan(ab.begin(), ab.end(), lens) && lens[0] == 1 && lens[1] == 2;
+	std::cout << "dfa: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_scanner() {
+	Grammar gr("test_scanner");
+	gr
+	<< Nonterms({"decl", "decls"})
+	<< Keywords({"CONST", "TYPE", "VAR", "VARIANT", "PROCEDURE", ";"})
+	<< Regexp("id", "[a-zA-Z]+")
+	<< Rule(R("decls"), Iter({R("decl"), R(";")}))
+	<< Rule(R("decl"), Seq({R("CONST"), R("id")}))
+	<< Rule(R("decl"), Seq({R("TYPE"), R("id")}))
+	<< Rule(R("decl"), Seq({R("VARIANT"), R("id")}))
+	<< Rule(R("decl"), Seq({R("VAR"), R("id")}))
+	<< Rule(R("decl"), Seq({R("PROCEDURE"), R("id")}))
+	<< Rule(R("decl"), Seq({R("id")}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	bool ret = p.trees["decl"].scanner != nullptr;
+	ret &= make_test(p, "CONST a; VAR b; VARIANT c; PROCEDURE d; TYPES; VARx", "decls", false);
+	ret &= make_test(p, "CONST a; VAR b; VARIANT c; PROCEDURE d; TYPES; VARx;", "decls");
+	return ret;
+}
+
+bool test_symb_ids() {
+	Grammar gr("test_symb_ids");
+	gr
+	<< Nonterms({"A", "A"}) << Keywords({"(", ")", "x"})
+	<< Keyword("lpar", "(") << Regexp("num", "[0-9]+")
+	<< Rule(R("A"), Seq({R("("), R("x"), R(")")}))
+	<< Rule(R("A"), Seq({R("lpar"), R("num"), R(")")}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	bool ret = gr.symb_map["("]->id == gr.symb_map["lpar"]->id;
+	ret &= gr.symb_map["("]->id != gr.symb_map["x"]->id;
+	ret &= gr.symb_ids.size() == gr.symbs.size() - 2;
+	ret &= p.trees["A"].size() == 1; // both rules start with the same symbol
+	ret &= make_test(p, "(x)", "A");
+	ret &= make_test(p, "(12)", "A");
+	return ret;
+}
+
+bool test_flatten() {
+	auto build = [](Grammar& gr) {
+		gr << Nonterms({"M", "K", "L"}) << Keywords({"a", "b", "c", "d"})
+		<< Rule(R("M"), Seq({R("a"), Seq({R("b"), R("c")}), R("d")}))
+		<< Rule(R("K"), Opt({R("a"), R("b")}))
+		<< Rule(R("L"), Alt({R("a"), Iter({R("b"), Opt(R("c"))}), Seq({R("c"), Alt({R("a"), R("d")})})}));
+		gr.flaten_ebnf();
+	};
+	Grammar gr("test_flatten"), same("test_flatten");
+	build(gr);
+	build(same);
+	bool ret = gr.show() == same.show();
+	ret &= gr.show(false) ==
+		"Rule: M = a b c d\n"
+		"Rule: K = a b\n"
+		"Rule: L = c N_0\n"
+		"Rule: K = <EMPTY>\n"
+		"Rule: L = a\n"
+		"Rule: L = N_1\n"
+		"Rule: N_0 = a\n"
+		"Rule: N_0 = d\n"
+		"Rule: N_1 = b N_2 N_1\n"
+		"Rule: N_1 = <EMPTY>\n"
+		"Rule: N_2 = c\n"
+		"Rule: N_2 = <EMPTY>\n\n";
+	Parser p(gr);
+	ret &= make_test(p, "a b c d", "M");
+	ret &= make_test(p, "", "K");
+	ret &= make_test(p, "a b a b", "K", false);
+	ret &= make_test(p, "b c b b", "L");
+	std::cout << "flatten: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_optimize() {
+	auto build = [](Grammar& gr) {
+		gr
+		<< Nonterms({"S", "Stmt", "Assign", "Expr", "Sum", "Term", "Atom", "Unused", "Loop", "P", "N"})
+		<< Keywords({";", "=", "+", "(", ")", "x", "y", "z", "b", "c"})
+		<< Regexp("id", "[a-w]+") << Regexp("num", "[0-9]+")
+		<< Rule(R("S"), Seq({R("Stmt"), Iter({R(";"), R("Stmt")})}))
+		<< Rule(R("Stmt"), Alt({R("Assign"), R("P")}))
+		<< Rule(R("Assign"), Seq({R("id"), R("="), R("Expr")}))
+		<< Rule(R("Expr"), R("Sum"))
+		<< Rule(R("Sum"), Seq({R("Term"), Iter({R("+"), R("Term")})}))
+		<< Rule(R("Term"), R("Atom"))
+		<< Rule(R("Atom"), Alt({R("num"), R("id"), Seq({R("("), R("Expr"), R(")")})}))
+		<< Rule(R("Unused"), R("id"))
+		<< Rule(R("Atom"), Seq({R("Loop"), R("+")}))
+		<< Rule(R("Loop"), Seq({R("("), R("Loop"), R(")")}))
+		<< Rule(R("P"), Alt({Seq({R("x"), R("N"), R("y")}), Seq({R("x"), R("b"), R("z")})}))
+		<< Rule(R("N"), Seq({R("b"), R("c")}));
+		gr.flaten_ebnf();
+	};
+	Grammar gr("test_optimize"), orig("test_optimize");
+	build(gr);
+	build(orig);
+	Optimization report = optimize(gr, {"S"});
+	bool ret = report.unproductive == 2 && report.unreachable == 1 && report.collapsed > 0 && report.inlined > 0;
+	ret &= report.rules[1] < report.rules[0] && report.symbols[1] < report.symbols[0];
+	// one line for each change, then the totals
+	ret &= report.log.size() == report.unproductive + report.unreachable + report.collapsed + report.inlined;
+	ret &= report.log.size() > 2 && report.log[2] == "removed unreachable Rule: Unused = id";
+	ret &= report.show().find("rules: " + std::to_string(report.rules[0]) + " -> " + std::to_string(report.rules[1])) != string::npos;
+	bool n_kept = false;
+	for (const Rule* r : gr.rules) n_kept |= r->left->name == "N"; // its inlining would merge with x b z
+	ret &= n_kept;
+	Parser p(gr), q(orig);
+	for (string str : {"a = 1", "a = (b + 1) + c; x b c y; x b z", "a = ; b", "x b c z", "a = ((1)", "a = 1 + 2 + (3 + 4)"}) {
+		Expr* a = p.parse(str, "S");
+		Expr* b = q.parse(str, "S");
+		ret &= !a == !b && (!a || a->show() == b->show());
+		for (Expr* e : {a, b}) if (e) delete e;
+	}
+	// N1 and N2 are inlined into rules of M, whose x paths must not merge ahead of B
+	auto order = [](Grammar& gr) {
+		gr
+		<< Nonterms({"M", "N1", "N2", "B"})
+		<< Keywords({"a", "x", "y", "w", "z"})
+		<< Rule(R("M"), Seq({R("a"), R("N1")}))
+		<< Rule(R("M"), Seq({R("a"), R("B")}))
+		<< Rule(R("M"), Seq({R("a"), R("N2")}))
+		<< Rule(R("N1"), Seq({R("x"), R("y")}))
+		<< Rule(R("N2"), Seq({R("x"), R("w")}))
+		<< Rule(R("B"), Seq({R("x"), R("w"), R("z")}));
+		gr.flaten_ebnf();
+	};
+	Grammar m("test_optimize_order"), m_orig("test_optimize_order");
+	order(m);
+	order(m_orig);
+	optimize(m, {"M"});
+	Parser pm(m), qm(m_orig);
+	for (string str : {"a x w z", "a x y", "a x w", "a x z"}) {
+		Expr* a = pm.parse(str, "M");
+		Expr* b = qm.parse(str, "M");
+		ret &= !a == !b;
+		for (Expr* e : {a, b}) if (e) delete e;
+	}
+	std::cout << "optimize: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_lookahead() {
+	Grammar gr("test_lookahead");
+	gr
+	<< Nonterms({"E", "T", "F"})
+	<< Keywords({"+", "*", "(", ")"})
+	<< Regexp("num", "[0-9]+")
+	<< Rule(R("E"), Seq({R("T"), Iter({R("+"), R("T")})}))
+	<< Rule(R("T"), Seq({R("F"), Iter({R("*"), R("F")})}))
+	<< Rule(R("F"), Alt({R("num"), Seq({R("("), R("E"), R(")")})}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	bool ret = true;
+	for (const char* nt : {"E", "T", "F"}) {
+		const Symb* s = gr.symb_map[nt];
+		ret &= p.trees[nt].single && !p.analysis.nullable[s->id];
+	}
+	ret &= p.analysis.first[gr.symb_map["E"]->id].count() == 11;
+	ret &= p.trees["F"].range != nullptr;
+	// the code of F pushes no choice
+	uint f = p.program.index.at(&p.trees["F"]);
+	uint f_end = p.program.code.size();
+	for (uint e : p.program.entries) if (e > p.program.entries[f]) f_end = std::min(f_end, e);
+	for (uint pc = p.program.entries[f]; pc < f_end; ++ pc) ret &= p.program.code[pc].op != vm::CHOICE;
+	ret &= make_test(p, "1 + 2 * (3 + 4) * 5", "E");
+	ret &= make_test(p, "1 + 2 * (3 + 4 * 5", "E", false);
+	ret &= make_test(p, "(1)", "F");
+	return ret;
+}
+
+bool test_arena() {
+	Grammar gr("test_arena");
+	sum_grammar(gr);
+	Parser p(gr);
+	bool ret = true;
+	ExprArena arena(256);
+	uint accepted = 0; // the checks below must not pass on rejected inputs only
+	for (bool packrat : {false, true}) {
+		for (string str : {"a + (b + c) + d", "((a)) + b + (c", "(a + (b)) + c"}) {
+			Expr* heap = p.parse(str, "E", packrat);
+			Expr* ex = p.parse(str, "E", arena, packrat);
+			ret &= !heap == !ex && (str[1] != '(') == !!ex;
+			if (heap && ex) ret &= heap->show() == ex->show();
+			if (!ex) ret &= arena.size() == 0;
+			accepted += !!ex;
+			delete heap;
+			arena.clear();
+		}
+	}
+	ret &= accepted == 4;
+	std::cout << "arena: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_flat() {
+	Grammar gr("test_flat");
+	sum_grammar(gr);
+	Parser p(gr);
+	bool ret = true;
+	string str = "a + (bc + d)";
+	FlatTree flat;
+	ret &= p.parse(str, "E", flat);
+	Expr* ex = p.parse(str, "E");
+	ret &= ex && flat.show(str) == ex->show();
+	delete ex;
+	ret &= gr.rules[flat.root().rule]->left->show() == "E" && flat.root().size == 2;
+	const FlatTree::Node& tail = *(flat.begin(flat.root()) + 1);
+	ret &= !tail.lexeme() && flat.text(tail, str) == "+ (bc + d)";
+	FlatTree copy = flat;
+	ret &= copy.show(str) == flat.show(str);
+	// built while parsing, flattened from expressions (packrat) and from the trie walk: the same nodes
+	for (string s : {"a + (bc + d)", "((a)) + b + (c + (d))"}) {
+		FlatTree built, walked;
+		Expr* e = p.parse(s, "E");
+		ret &= p.parse(s, "E", built) && p.parse(s, "E", copy, true) && e;
+		p.engine = Parser::TRIES;
+		ret &= p.parse(s, "E", walked);
+		p.engine = Parser::BYTECODE;
+		FlatTree expected(e, s.data());
+		for (const FlatTree* t : {&built, &copy, &walked}) {
+			ret &= t->size() == expected.size();
+			for (uint i = 0; i < t->size() && i < expected.size(); ++ i) {
+				const FlatTree::Node& a = (*t)[i];
+				const FlatTree::Node& b = expected[i];
+				ret &= a.rule == b.rule && a.beg == b.beg && a.end == b.end && a.first == b.first && a.size == b.size;
+			}
+		}
+		delete e;
+	}
+	ret &= !p.parse(str = "a + (b", "E", flat) && flat.empty();
+	std::cout << "flat: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_mapped() {
+	Grammar gr("test_mapped");
+	sum_grammar(gr);
+	Parser p(gr);
+	bool ret = true;
+	const char* text = "a + (b + c) + d";
+	// prefixes of a buffer, the parser must not look past their ends
+	Expr* ex = p.parse(Source::of(text, 9), "E");
+	ret &= !ex && !p.parse(Source::of(text, 0), "E");
+	ex = p.parse(Source::of(text, 11), "E");
+	ret &= ex && ex->show() == "a+(b+c)";
+	delete ex;
+	char path[] = "/tmp/dp_mapped_XXXXXX";
+	int fd = mkstemp(path);
+	ret &= write(fd, text, strlen(text)) == ssize_t(strlen(text));
+	close(fd);
+	{
+		MappedFile file(path);
+		Expr* mex = p.parse(file, "E");
+		ret &= mex && mex->show() == "a+(b+c)+d" && mex->beg == file.data();
+		delete mex;
+	}
+	unlink(path);
+	std::cout << "mapped: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_parse_many() {
+	Grammar gr("test_parse_many");
+	gr
+	<< Nonterms({"E", "T"}) << Keywords({"+", "*", "(", ")"})
+	<< Regexp("id", "[a-z]+") << Regexp("num", "[0-9]+")
+	<< Rule(R("E"), Seq({R("T"), Iter({Alt({R("+"), R("*")}), R("T")})}))
+	<< Rule(R("T"), Seq({R("("), R("E"), R(")")}))
+	<< Rule(R("T"), Seq({R("id")}))
+	<< Rule(R("T"), Seq({R("num")}));
+	gr.flaten_ebnf();
+	const Parser p(gr);
+	vector<string> docs;
+	for (int i = 0; i < 1000; ++ i) {
+		string d = string(1 + i % 3, 'a' + i % 26);
+		for (int j = 0; j < i % 7; ++ j) d = "(" + d + " + y) * " + std::to_string(i + j);
+		docs.push_back(i % 10 ? d : d + " +");
+	}
+	vector<Source> srcs(docs.begin(), docs.end());
+	vector<Expr*> res = p.parse_many(srcs, "E", 4);
+	bool ret = res.size() == docs.size();
+	for (size_t i = 0; ret && i < docs.size(); ++ i) {
+		Expr* ex = p.parse(docs[i], "E");
+		ret &= !ex == !res[i] && !res[i] == (i % 10 == 0);
+		if (ex && res[i]) ret &= ex->show() == res[i]->show();
+		if (ex) delete ex;
+	}
+	for (Expr* ex : res) if (ex) delete ex;
+	// the threads of the pool serve every batch
+	std::set<std::thread::id> ids;
+	std::mutex ids_mutex;
+	for (int batch = 0; batch < 3; ++ batch) {
+		p.pool(4).run(64, [&](size_t) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+			std::lock_guard<std::mutex> lock(ids_mutex);
+			ids.insert(std::this_thread::get_id());
+		});
+	}
+	ret &= ids.size() <= 4 && &p.pool(4) == &p.pool(4);
+	std::cout << "parse_many: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_add_rule() {
+	Grammar gr("test_add_rule");
+	sum_grammar(gr, false);
+	Parser p(gr);
+	bool ret = true;
+	ret &= make_test(p, "a + b", "E");
+	ret &= make_test(p, "a + (b + c)", "E", false);
+	const Rule* paren = p.add_rule(Rule(R("T"), Seq({R("("), R("E"), R(")")})));
+	ret &= make_test(p, "a + (b + c)", "E");
+	gr << Nonterms({"L"}) << Keywords({"[", "]", ","}) << Regexp("num", "[0-9]+");
+	const Rule* list = p.add_rule(Rule(R("T"), Seq({R("["), Opt({R("E"), Iter({R(","), R("E")})}), R("]")})));
+	const Rule* helper = gr.rules[list->id + 1]; // a rule the iteration is flattened into
+	p.add_rule(Rule(R("T"), Seq({R("num")})));
+	// the analysis grown by the added rules is the one of the whole grammar
+	Analysis full(gr);
+	ret &= full.first == p.analysis.first && full.follow == p.analysis.follow && full.nullable == p.analysis.nullable;
+	ret &= make_test(p, "[a, (b + 1), []] + 2", "E");
+	ret &= make_test(p, "[a, (b + 1), []] + 2", "E", true, true);
+	// only the code of the changed tries is compiled again
+	const vm::Program& prog = p.program;
+	uint e = prog.entries[prog.index.at(&p.trees["E"])];
+	size_t code = prog.code.size();
+	p.add_rule(Rule(R("L"), Seq({R("["), R("num"), R("]")})));
+	ret &= prog.entries[prog.index.at(&p.trees["E"])] == e && prog.code.size() < code + 20;
+	ret &= make_test(p, "[1]", "L");
+	string str = "[a, b] + (c)";
+	Expr* ex = p.parse_tokens(str, "E");
+	ret &= ex != nullptr;
+	delete ex;
+	p.remove_rule(paren);
+	ret &= make_test(p, "[a, (b + 1), []] + 2", "E", false);
+	ret &= make_test(p, "[a, [b + 1], []] + 2", "E");
+	size_t rules = gr.rules.size();
+	try {
+		p.remove_rule(helper);
+		ret = false;
+	} catch (std::exception&) {
+	}
+	p.remove_rule(list);
+	ret &= make_test(p, "[a] + 2", "E", false);
+	ret &= make_test(p, "a + 2", "E");
+	ret &= gr.rules.size() < rules - 1;
+	for (uint i = 0; i < gr.rules.size(); ++ i) ret &= gr.rules[i]->id == i;
+	// the result must be the same as with a parser built from scratch
+	Parser q(gr);
+	ret &= show(q) == show(p);
+	std::cout << "add_rule: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_versioned() {
+	std::unique_ptr<Grammar> gr(new Grammar("test_versioned"));
+	sum_grammar(*gr, false);
+	VersionedParser vp(*gr);
+	gr.reset(); // versions own copies
+	std::atomic<bool> ret(true);
+	std::atomic<bool> done(false);
+	auto reader = [&]() {
+		string str = "a + (b + c)";
+		while (!done) {
+			VersionedParser::Snapshot snap = vp.snapshot();
+			Expr* ex = snap->parser.parse(str, "E");
+			if (!ex != (snap->number == 0)) ret = false;
+			if (ex && ex->show() != "a+(b+c)") ret = false;
+			delete ex;
+		}
+	};
+	vector<std::thread> readers;
+	for (int i = 0; i < 3; ++ i) readers.emplace_back(reader);
+	vp.update([](Grammar& g) { g << Rule(R("T"), Seq({R("("), R("E"), R(")")})); });
+	for (int i = 0; i < 5; ++ i) {
+		vp.update([i](Grammar& g) {
+			string kw = "@" + std::to_string(i);
+			g << Keyword(kw) << Rule(R("T"), Seq({R(kw)}));
+		});
+	}
+	done = true;
+	for (std::thread& t : readers) t.join();
+	VersionedParser::Snapshot last = vp.snapshot();
+	ret = ret && last->number == 6 && last->grammar->rules.size() == 10;
+	string str = "@4 + (@0 + a)";
+	Expr* ex = last->parser.parse(str, "E");
+	ret = ret && ex;
+	delete ex;
+	std::cout << "versioned: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_deep() {
+	Grammar gr("test_deep");
+	sum_grammar(gr);
+	Parser p(gr);
+	const int depth = 200000; // far beyond what recursion on the call stack would take
+	string str = string(depth, '(') + "a" + string(depth, ')') + " + b";
+	bool ret = true;
+	FlatTree flat;
+	for (int i = 0; i < 2; ++ i) { // the second time in the warm context
+		ret &= p.parse(str, "E", flat);
+		ret &= flat.size() > 3 * depth && flat.text(flat.root(), str) == str;
+	}
+	// a tree on heap is destroyed without recursion too
+	for (auto engine : {Parser::BYTECODE, Parser::TRIES}) {
+		p.engine = engine;
+		Expr* ex = p.parse(str, "E");
+		ret &= ex && size_t(ex->end - ex->beg) == str.size();
+		delete ex;
+	}
+	str.pop_back();
+	ret &= !p.parse(str, "E", flat);
+	// a failed parse releases its partial tree
+	for (auto engine : {Parser::BYTECODE, Parser::TRIES}) {
+		p.engine = engine;
+		ret &= !p.parse(str, "E");
+	}
+	std::cout << "deep: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_vm() {
+	Grammar gr("test_vm");
+	expr_grammar(gr);
+	Parser p(gr);
+	bool ret = true;
+	int parsed = 0;
+	for (string str : {"1;", "let x = 1 + 2 * y; x * (x + 3);", "let = 1;", "a + (b * (c + 1)) * 2; let y = (1;",
+		"((((1)))) * 2 + a * b * c; letx = 2;", "let x = 1"}) {
+		for (bool packrat : {false, true}) {
+			p.engine = Parser::TRIES;
+			Expr* a = p.parse(str, "S", packrat);
+			Expr* b = p.parse_tokens(str, "S", packrat);
+			p.engine = Parser::BYTECODE;
+			Expr* c = p.parse(str, "S", packrat);
+			Expr* d = p.parse_tokens(str, "S", packrat);
+			ret &= !a == !c && !b == !d;
+			parsed += c != nullptr;
+			if (a && c) ret &= FlatTree(a, str.data()).nodes.size() == FlatTree(c, str.data()).nodes.size() && a->show() == c->show();
+			if (b && d) ret &= b->show() == d->show();
+			for (Expr* e : {a, b, c, d}) if (e) delete e;
+		}
+	}
+	ret &= parsed == 6;
+	std::cout << "vm: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_codegen() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	Parser p(gr);
+	gen::ExprParser g(gr);
+	bool ret = true;
+	auto same = [](const FlatTree& a, const FlatTree& b) {
+		if (a.size() != b.size()) return false;
+		for (uint i = 0; i < a.size(); ++ i) {
+			if (a[i].rule != b[i].rule || a[i].beg != b[i].beg || a[i].end != b[i].end || a[i].size != b[i].size) return false;
+		}
+		return true;
+	};
+	int parsed = 0;
+	for (string str : {"1;", "let x = 1 + 2 * y; x * (x + 3);", "let = 1;", "a + (b * (c + 1)) * 2; let y = (1;",
+		"((((1)))) * 2 + a * b * c; letx = 2;", "let x = 1", "  x ;  ", "1 + 2 * (x + 3)"}) {
+		Expr* a = p.parse(str, "S");
+		Expr* b = g.parse(str, "S");
+		ret &= !a == !b;
+		if (a && b) ret &= a->show() == b->show() && same(FlatTree(a, str.data()), FlatTree(b, str.data()));
+		parsed += b != nullptr;
+		for (Expr* e : {a, b}) if (e) delete e;
+		ExprArena arena;
+		Expr* c = g.parse(str, "E", &arena);
+		Expr* d = p.parse(str, "E", arena);
+		ret &= !c == !d;
+		if (c && d) ret &= same(FlatTree(c, str.data()), FlatTree(d, str.data()));
+		parsed += c != nullptr;
+	}
+	ret &= parsed == 5;
+	Grammar other("other");
+	expr_grammar(other);
+	try {
+		gen::ExprParser h(other);
+		ret = false;
+	} catch (std::exception&) { }
+	// the same name, but a rule more
+	Grammar changed("expr");
+	expr_grammar(changed);
+	changed << Rule(R("F"), Seq({R("let"), R("F")}));
+	changed.flaten_ebnf();
+	try {
+		gen::ExprParser h(changed);
+		ret = false;
+	} catch (std::exception&) { }
+	std::cout << "codegen: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_image() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	gr << Nonterms({"W"}) << Regexp("word", "[a-z]+(?![0-9])") << Rule(R("W"), Iter({R("word")}));
+	gr.flaten_ebnf();
+	Parser p(gr);
+	char path[] = "/tmp/dp_image_XXXXXX";
+	close(mkstemp(path));
+	{
+		std::ofstream out(path, std::ios::binary);
+		Image::write(p, out);
+	}
+	bool ret = true;
+	{
+		Image image(path);
+		ret &= image.fingerprint() == gr.fingerprint() && image.rules() == gr.rules.size();
+		int parsed = 0;
+		for (string str : {"1;", "let x = 1 + 2 * y; x * (x + 3);", "let = 1;", "a + (b * (c + 1)) * 2; let y = (1;",
+			"((((1)))) * 2 + a * b * c; letx = 2;", "let x = 1", "  x ;  "}) {
+			for (bool packrat : {false, true}) {
+				FlatTree a, b;
+				ret &= p.parse(str, "S", a, packrat) == image.parse(str, "S", b, packrat);
+				ret &= a.size() == b.size() && a.show(str) == b.show(str);
+				for (uint i = 0; i < a.size() && i < b.size(); ++ i) ret &= a[i].rule == b[i].rule && a[i].end == b[i].end;
+				if (!b.empty()) ret &= image.left(b.root().rule) == "S";
+				parsed += !b.empty();
+			}
+		}
+		ret &= parsed == 8;
+		FlatTree w;
+		string good = "ab cd", bad = "ab cd1";
+		ret &= image.parse(good, "W", w) && !image.parse(bad, "W", w);
+		try {
+			image.parse(good, "X", w);
+			ret = false;
+		} catch (std::exception&) { }
+	}
+	{
+		std::ofstream out(path, std::ios::binary);
+		out << "not a grammar";
+	}
+	try {
+		Image image(path);
+		ret = false;
+	} catch (std::exception&) { }
+	// tables, which point out of each other, are refused
+	std::ostringstream os;
+	Image::write(p, os);
+	const string bytes = os.str();
+	auto refused = [&](Image::Part part, size_t at, uint32_t value) {
+		Image::Header h;
+		std::memcpy(&h, bytes.data(), sizeof(h));
+		string broken = bytes;
+		std::memcpy(&broken[h.sections[part].offset + at], &value, sizeof(value));
+		{
+			std::ofstream out(path, std::ios::binary);
+			out << broken;
+		}
+		try {
+			Image image(path);
+			return false;
+		} catch (std::exception&) {
+			return true;
+		}
+	};
+	uint call = 0, commit = 0;
+	while (p.program.code[call].op != vm::CALL) ++ call;
+	while (commit < p.program.code.size() && p.program.code[commit].op != vm::COMMIT) ++ commit;
+	ret &= !refused(Image::ENTRIES, 0, 0);
+	ret &= refused(Image::ENTRIES, 0, 1 << 30);
+	ret &= refused(Image::CODE, call * sizeof(vm::Instr) + offsetof(vm::Instr, arg), 1 << 30);
+	ret &= commit < p.program.code.size() && refused(Image::CODE, commit * sizeof(vm::Instr) + offsetof(vm::Instr, arg), p.program.code[commit].arg + 1);
+	ret &= refused(Image::TRANS, 256 * sizeof(int32_t), 1 << 30); // a successor of the start state
+	ret &= refused(Image::TERMINALS, offsetof(Image::Terminal, text), 1 << 30);
+	unlink(path);
+	std::cout << "image: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_blanks() {
+	bool ret = true;
+	Skipper* skippers[] = {
+		[](char c)->bool { return c <= ' '; },                                     // an interval
+		[](char c)->bool { return c == ' ' || c == '\t' || c == '\n' || c == '\r'; }, // a few chars
+		[](char c)->bool { return c == ' ' || c == '_' || (c >= '0' && c <= '9'); }   // a table
+	};
+	const char blank[] = " \t\n\r_0\x80", other[] = "ab;";
+	std::mt19937 rnd(7);
+	for (Skipper* s : skippers) {
+		Blanks b(s);
+		for (uint i = 0; i < 100; ++ i) {
+			string str;
+			for (uint k = rnd() % 150; k; -- k) str += rnd() % 20 ? blank[rnd() % 7] : other[rnd() % 3];
+			for (size_t k = 0; k <= str.size(); ++ k) {
+				StrIter p = str.data() + k, q = p, end = str.data() + str.size();
+				b.skip(p, end);
+				skip(s, q, end);
+				ret &= p == q;
+			}
+		}
+	}
+	Grammar gr("expr");
+	expr_grammar(gr);
+	gr.set_comments({Comment{"//", "\n"}, Comment{"/*", "*/"}});
+	gr.flaten_ebnf();
+	Parser p(gr);
+	char path[] = "/tmp/dp_image_XXXXXX";
+	close(mkstemp(path));
+	{
+		std::ofstream out(path, std::ios::binary);
+		Image::write(p, out);
+	}
+	Image image(path);
+	for (string str : {"let x = 1 /* one */ + 2; // two\n x;", "/**/x;/* a\n b */ // end", "x /* open;", "x; /* 1; */ 2; // 3;"}) {
+		bool ok = str.find("open") == string::npos;
+		Expr* a = p.parse(str, "S");
+		Expr* b = p.parse_tokens(str, "S");
+		FlatTree c;
+		ret &= !a == !ok && !b == !ok && image.parse(str, "S", c) == ok;
+		if (a && b) ret &= a->show() == b->show() && c.show(str) == a->show();
+		for (Expr* e : {a, b}) if (e) delete e;
+	}
+	unlink(path);
+	std::cout << "blanks (" << Blanks::simd() << "): " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+/// The tree with the rule id of each node: [id children].
+string bracket(const Expr* ex) {
+	const expr::Operator* op = dynamic_cast<const expr::Operator*>(ex);
+	if (!op) return ex->show();
+	string ret = "[" + std::to_string(op->rule->id);
+	for (const Expr* n : op->nodes) ret += " " + bracket(n);
+	return ret + "]";
+}
+
+bool test_events() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	Parser p(gr);
+	Actions<string> brackets(
+		[](uint, StrIter b, StrIter e) { return string(b, e); },
+		[](uint rule, string* kids, size_t n, StrIter, StrIter) {
+			string ret = "[" + std::to_string(rule);
+			for (size_t i = 0; i < n; ++ i) ret += " " + kids[i];
+			return ret + "]";
+		});
+	bool ret = true;
+	for (string str : {"1;", "let x = 1 + 2 * y; x * (x + 3);", "let = 1;", " ((1)) * 2 + a * b; letx = 2; ", "let x = 1"}) {
+		Expr* ex = p.parse(str, "S");
+		brackets.clear();
+		ret &= p.parse(str, "S", brackets) == bool(ex);
+		if (ex) {
+			ret &= brackets.result() == bracket(ex);
+			delete ex;
+		}
+	}
+	// events of the alternatives, which failed, are not delivered
+	struct Log : public Handler {
+		string text;
+		void enter(uint nt, StrIter) override { text += "<" + std::to_string(nt); }
+		void token(uint, StrIter b, StrIter e) override { text += " " + string(b, e); }
+		void exit(uint rule, StrIter, StrIter) override { text += " " + std::to_string(rule) + ">"; }
+	} log;
+	Grammar alt("alt");
+	alt << Nonterms({"A", "B", "C"}) << Keywords({"x", "y", "z"})
+		<< Rule(R("A"), Alt({Seq({R("B"), R("y")}), Seq({R("C"), R("z")})}))
+		<< Rule(R("B"), R("x")) << Rule(R("C"), R("x"));
+	alt.flaten_ebnf();
+	Parser q(alt);
+	string expected = "<" + std::to_string(alt.symb_map.at("A")->id) + "<" + std::to_string(alt.symb_map.at("C")->id) + " x ";
+	for (const Rule* r : alt.rules) if (r->left->name == "C") expected += std::to_string(r->id) + "> z ";
+	for (const Rule* r : alt.rules) if (r->show() == "Rule: A = C z") expected += std::to_string(r->id) + ">";
+	string xz = "x z";
+	ret &= q.parse(xz, "A", log) && log.text == expected;
+	// a list is delivered as it is parsed: the pending events stay few
+	string list;
+	for (uint i = 0; i < 5000; ++ i) list += "x + " + std::to_string(i) + ";\n";
+	ParseContext::local().events = vector<Event>();
+	log.text.clear();
+	ret &= p.parse(list, "S", log) && ParseContext::local().events.capacity() < 64;
+	std::cout << "events: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_serialize() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	Parser p(gr);
+	bool ret = true;
+	string str = "1;";
+	Expr* ex = p.parse(str, "S");
+	string sexpr, json;
+	StringOut s{sexpr}, j{json};
+	write_sexpr(s, *ex);
+	write_json(j, *ex);
+	std::ostringstream os;
+	os << *ex;
+	ret &= sexpr == "(S (N_0 (N_3 (E (T (F \"1\") (N_2 \"\")) (N_1 \"\"))) \";\" (N_0 \"\")))";
+	ret &= json.substr(0, 64) == "{\"rule\":\"S\",\"id\":0,\"children\":[{\"rule\":\"N_0\",\"id\":5,\"children\":[";
+	ret &= os.str() == ex->show() && ex->show() == "1;";
+	char buf[16];
+	BufferOut b{buf, sizeof(buf), 0};
+	write_sexpr(b, *ex);
+	ret &= !b.fits() && b.len == sexpr.size() && !sexpr.compare(0, sizeof(buf), buf, sizeof(buf));
+	delete ex;
+	// escaping
+	Grammar q("quotes");
+	q << Nonterms({"Q\"\\"}) << Regexp("str", "\"[^\"]*\"") << Rule(R("Q\"\\"), R("str"));
+	q.flaten_ebnf();
+	Parser pq(q);
+	str = "\"a\\\tb\x01\"";
+	ex = pq.parse(str, "Q\"\\");
+	json.clear();
+	write_json(j, *ex);
+	ret &= json == "{\"rule\":\"Q\\\"\\\\\",\"id\":0,\"children\":[\"\\\"a\\\\\\tb\\u0001\\\"\"]}";
+	delete ex;
+	// deep trees are written without recursion
+	string deep = string(100000, '(') + "1" + string(100000, ')') + ";";
+	ExprArena arena;
+	ex = p.parse(deep, "S", arena);
+	std::ostringstream dos;
+	StreamOut d{dos};
+	write_json(d, *ex);
+	ret &= ex->show() == deep && dos.str().size() > deep.size();
+	std::cout << "serialize: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_cache() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	Parser p(gr);
+	char path[] = "/tmp/dp_tree_XXXXXX";
+	close(mkstemp(path));
+	unlink(path);
+	string src = "let x = 1 + 2 * y; x * (x + 3);";
+	FlatTree a, b, c;
+	bool ret = parse_cached(p, src, "S", path, a) && p.parse(src, "S", b);
+	ret &= a.size() == b.size() && a.show(src) == b.show(src);
+	{
+		TreeCache cache(path);
+		ret &= cache.key() == TreeCache::key(gr, src, "S") && cache.size() == a.size() && cache.root().rule == a.root().rule;
+	}
+	// a hit is loaded, not parsed: a fake tree under the same key comes back
+	{
+		std::ofstream out(path, std::ios::binary);
+		FlatTree fake;
+		fake.nodes.push_back(FlatTree::Node{FlatTree::LEXEME, 0, 3, 1, 0});
+		TreeCache::write(fake, TreeCache::key(gr, src, "S"), out);
+	}
+	ret &= parse_cached(p, src, "S", path, c) && c.size() == 1 && c.show(src) == "let";
+	// another start, source or grammar invalidates it
+	ret &= !parse_cached(p, src, "E", path, c) && c.empty();
+	ret &= parse_cached(p, src, "S", path, c) && c.size() == a.size();
+	string other = src + " 1;";
+	ret &= parse_cached(p, other, "S", path, c) && c.show(other) == "letx=1+2*y;x*(x+3);1;";
+	uint64_t before = TreeCache::key(gr, other, "S").grammar;
+	gr << Keywords({"-"});
+	p.add_rule(Rule(R("F"), Seq({R("-"), R("F")})));
+	ret &= TreeCache::key(gr, other, "S").grammar != before;
+	string neg = "x * -1;";
+	ret &= parse_cached(p, neg, "S", path, c) && c.show(neg) == "x*-1;";
+	{
+		std::ofstream out(path, std::ios::binary);
+		out << "not a tree";
+	}
+	ret &= parse_cached(p, neg, "S", path, c) && c.show(neg) == "x*-1;";
+	// so do other blanks
+	before = TreeCache::key(gr, neg, "S").grammar;
+	gr.set_comments({Comment{"#", "\n"}});
+	uint64_t commented = TreeCache::key(gr, neg, "S").grammar;
+	gr.set_skipper([](char c)->bool { return c == ' '; });
+	ret &= commented != before && TreeCache::key(gr, neg, "S").grammar != commented;
+	unlink(path);
+	std::cout << "cache: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_incremental() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	Parser p(gr);
+	string src;
+	for (uint i = 0; i < 50; ++ i) src += "let x = " + std::to_string(i) + " + y * (z + 1); ";
+	IncrementalParser inc(p, "S");
+	bool ret = inc.parse(src);
+	// a reparse gives the tree of a full parse of the new source
+	auto check = [&](const vector<IncrementalParser::Edit>& edits, bool parsed) {
+		src = IncrementalParser::apply(src, edits);
+		FlatTree full;
+		bool ok = inc.reparse(src, edits) == parsed && p.parse(src, "S", full) == parsed && inc.tree().size() == full.size();
+		for (uint i = 0; ok && i < full.size(); ++ i) {
+			const FlatTree::Node& a = inc.tree()[i];
+			const FlatTree::Node& b = full[i];
+			ok = a.rule == b.rule && a.beg == b.beg && a.end == b.end && a.first == b.first && a.size == b.size;
+		}
+		return ok;
+	};
+	uint size = inc.tree().size();
+	ret &= check({{uint(src.find("17")), 2, "1234"}}, true);
+	ret &= inc.reused() > size / 2; // the statements around the edit are copied
+	ret &= check({{0, 3, "let"}, {uint(src.size() - 2), 1, "; x;"}}, true);
+	ret &= check({{uint(src.find("y *")), 1, ""}}, false); // "*" without a left operand
+	ret &= !inc.reused() && inc.tree().empty();
+	ret &= check({{uint(src.find(" * (")), 0, "y"}}, true); // parsed from scratch
+	ret &= check({{uint(src.find("+ 1)")), 3, "* (2 + 3)"}, {uint(src.rfind("let")), 0, "(a); "}}, true);
+	ret &= inc.reused() > size / 2; // distant edits dirty only their paths
+	ret &= check({}, true) && inc.reused() + 1 == inc.tree().size(); // all but the root
+	std::cout << "incremental: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_push() {
+	Grammar gr("expr");
+	expr_grammar(gr);
+	gr.set_comments({{"/*", "*/"}, {"//", "\n"}});
+	Parser p(gr);
+	// the events with offsets, from a whole source and from chunks
+	struct Log : public Handler {
+		StrIter origin;
+		string text;
+		void enter(uint nt, StrIter pos) override { text += "<" + std::to_string(nt) + "@" + std::to_string(pos - origin); }
+		void token(uint, StrIter b, StrIter e) override { text += " " + string(b, e); }
+		void exit(uint rule, StrIter b, StrIter e) override { text += " " + std::to_string(rule) + "@" + std::to_string(b - origin) + "-" + std::to_string(e - origin) + ">"; }
+	};
+	struct StreamLog : public StreamHandler {
+		string text;
+		void enter(uint nt, size_t pos) override { text += "<" + std::to_string(nt) + "@" + std::to_string(pos); }
+		void token(uint, StrIter b, StrIter e, size_t) override { text += " " + string(b, e); }
+		void exit(uint rule, size_t b, size_t e) override { text += " " + std::to_string(rule) + "@" + std::to_string(b) + "-" + std::to_string(e) + ">"; }
+	};
+	bool ret = true;
+	for (string str : {"1;", " let x = 1 + 2 * y; /* 1; */ x * (x + 3); // 2;", "let = 1;", "let x = 1", "1; 2", "letx = 2; 1; ", ""}) {
+		Log whole;
+		whole.origin = str.data();
+		bool ok = p.parse(str, "S", whole);
+		for (size_t chunk : {1, 2, 3, 7, 100}) {
+			StreamLog log;
+			PushParser push(p, "S", log);
+			for (size_t i = 0; i < str.size(); i += chunk) push.feed(Source::of(str.data() + i, std::min(chunk, str.size() - i)));
+			ret &= push.finish() == ok && (!ok || log.text == whole.text);
+		}
+	}
+	// a long source is parsed in a small buffer
+	StreamLog log;
+	PushParser push(p, "S", log);
+	size_t peak = 0;
+	for (uint i = 0; i < 2000; ++ i) {
+		string chunk = "let x = " + std::to_string(i) + " + (y * 2); // " + std::to_string(i) + "\n";
+		ret &= push.feed(chunk);
+		peak = std::max(peak, push.buffered());
+	}
+	ret &= push.finish() && peak < 200 && push.released() > 50000;
+	// an error stops the parse
+	PushParser bad(p, "S", log);
+	string head = "1 + 2; ", tail = "+ 3;";
+	ret &= bad.feed(head) && !bad.feed(tail) && bad.failed() && !bad.finish();
+	std::cout << "push: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
+bool test_parallel() {
+	Grammar gr("blocks");
+	gr << Nonterms({"B", "St", "E"}) << Keywords({"let", "=", "+", ";", "{", "}"})
+		<< Regexp("id", "[a-z]+") << Regexp("num", "[0-9]+")
+		<< Rule(R("B"), Iter({R("St"), R(";")}))
+		<< Rule(R("St"), Alt({Seq({R("let"), R("id"), R("="), R("E")}), Seq({R("{"), R("B"), R("}")})}))
+		<< Rule(R("E"), Seq({R("num"), Iter({R("+"), R("num")})}));
+	gr.set_comments({{"/*", "*/"}});
+	gr.flaten_ebnf();
+	Parser p(gr);
+	// the token is also in comments and nested blocks: those splits are wrong
+	string src;
+	for (uint i = 0; i < 3000; ++ i) {
+		src += "let x = " + std::to_string(i) + " + 1; ";
+		if (i % 7 == 0) src += "{ let y = 2; { let z = 3; }; /* ; let */ let w = 4; }; ";
+	}
+	bool ret = true;
+	for (string str : {src, src + "let = 1;", string("let x = 1;")}) {
+		FlatTree a, b;
+		bool ok = p.parse(str, "B", a);
+		ret &= parse_parallel(p, str, "B", {{";", "St"}, {"{", "B"}}, b, 4) == ok && a.size() == b.size();
+		for (uint i = 0; ret && i < a.size(); ++ i) {
+			ret = a[i].rule == b[i].rule && a[i].beg == b[i].beg && a[i].end == b[i].end && a[i].first == b[i].first && a[i].size == b[i].size;
+		}
+	}
+	std::cout << "parallel: " << (ret ? "OK" : "FAIL") << std::endl;
+	return ret;
+}
+
 bool test_ober() {
 	Grammar gr("oberon");
 	oberon_grammar(gr);
@@ -142,11 +1173,44 @@ bool all_tests() {
 	success &= test_1();
 	success &= test_2();
 	success &= test_3();
+	success &= test_packrat();
+	success &= test_tokens();
+	success &= test_dfa();
+	success &= test_scanner();
+	success &= test_symb_ids();
+	success &= test_flatten();
+	success &= test_optimize();
+	success &= test_lookahead();
+	success &= test_arena();
+	success &= test_flat();
+	success &= test_mapped();
+	success &= test_parse_many();
+	success &= test_add_rule();
+	success &= test_versioned();
+	success &= test_deep();
+	success &= test_vm();
+	success &= test_codegen();
+	success &= test_image();
+	success &= test_blanks();
+	success &= test_events();
+	success &= test_serialize();
+	success &= test_cache();
+	success &= test_incremental();
+	success &= test_push();
+	success &= test_parallel();
 	success &= test_ober();
 	return success;
 }
 
 int main(int argc, const char* argv[]) {
+	if (argc == 3 && string(argv[1]) == "gen") {
+		// dp gen src/expr_parser.hpp
+		Grammar gr("expr");
+		expr_grammar(gr);
+		std::ofstream out(argv[2]);
+		gen::generate(gr, "ExprParser", out);
+		return out ? 0 : 1;
+	}
 	std::cout << (all_tests() ? "SUCCESS" : "FAIL") << std::endl;
 	return 0;
 }
@@ -0,0 +1,346 @@
+#pragma once
+
+// Generated by dynaparse from grammar expr, do not edit.
+
+#include "codegen.hpp"
+
+namespace dynaparse {
+namespace gen {
+
+class ExprParser : public Runtime {
+public:
+	ExprParser(const Grammar& gr) : Runtime(gr, 0x600d8992fe3cd535ull, "ExprParser") { }
+
+	Expr* parse(Source src, const string& type, ExprArena* arena = nullptr) {
+		static const map<string, Expr* (ExprParser::*)(StrIter&)> starts = {
+			{"E", &ExprParser::nt_2},
+			{"F", &ExprParser::nt_4},
+			{"L", &ExprParser::nt_5},
+			{"N_0", &ExprParser::nt_15},
+			{"N_1", &ExprParser::nt_16},
+			{"N_2", &ExprParser::nt_17},
+			{"N_3", &ExprParser::nt_18},
+			{"S", &ExprParser::nt_1},
+			{"T", &ExprParser::nt_3},
+		};
+		auto it = starts.find(type);
+		if (it == starts.end()) undefined(type);
+		StrIter pos = start(src, arena);
+		Expr* ex = (this->*it->second)(pos);
+		return finish(ex, pos);
+	}
+
+private:
+	static constexpr uint64_t sets[][5] = {
+		{0x3ff010000000000ull, 0x7fffffe00000000ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x10000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x20000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x3ff000000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x0ull, 0x7fffffe00000000ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x0ull, 0x100000000000ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x2000000000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x800000000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x80000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+		{0x40000000000ull, 0x0ull, 0x0ull, 0x0ull, 0x0ull},
+	};
+
+	// E
+	Expr* nt_2(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "T"
+		if (first(p0, sets[0])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (push(nt_3(p1))) {
+				skip(p1);
+				// "N_1"
+				{
+					StrIter p2 = p1;
+					if (push(nt_16(p2))) {
+						return accept(b, p2, 2, base, pos);
+					}
+				}
+				drop(m1);
+			}
+		}
+		return nullptr;
+	}
+	// F
+	Expr* nt_4(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "("
+		if (first(p0, sets[1])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (last - p1 >= 1 && !std::memcmp(p1, "(", 1) && lexeme(p1, 1)) {
+				skip(p1);
+				// "E"
+				if (first(p1, sets[0])) {
+					StrIter p2 = p1;
+					ExprArena::Mark m2 = mark();
+					if (push(nt_2(p2))) {
+						skip(p2);
+						// ")"
+						if (first(p2, sets[2])) {
+							StrIter p3 = p2;
+							if (last - p3 >= 1 && !std::memcmp(p3, ")", 1) && lexeme(p3, 1)) {
+								return accept(b, p3, 4, base, pos);
+							}
+						}
+						drop(m2);
+					}
+				}
+				drop(m1);
+			}
+		}
+		// "num"
+		if (first(p0, sets[3])) {
+			StrIter p1 = p0;
+			if (regexp(p1, 14)) {
+				return accept(b, p1, 11, base, pos);
+			}
+		}
+		// "id"
+		if (first(p0, sets[4])) {
+			StrIter p1 = p0;
+			if (regexp(p1, 13)) {
+				return accept(b, p1, 12, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// L
+	Expr* nt_5(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "let"
+		if (first(p0, sets[5])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (last - p1 >= 3 && !std::memcmp(p1, "let", 3) && lexeme(p1, 3)) {
+				skip(p1);
+				// "id"
+				if (first(p1, sets[4])) {
+					StrIter p2 = p1;
+					ExprArena::Mark m2 = mark();
+					if (regexp(p2, 13)) {
+						skip(p2);
+						// "="
+						if (first(p2, sets[6])) {
+							StrIter p3 = p2;
+							ExprArena::Mark m3 = mark();
+							if (last - p3 >= 1 && !std::memcmp(p3, "=", 1) && lexeme(p3, 1)) {
+								skip(p3);
+								// "E"
+								if (first(p3, sets[0])) {
+									StrIter p4 = p3;
+									if (push(nt_2(p4))) {
+										return accept(b, p4, 1, base, pos);
+									}
+								}
+								drop(m3);
+							}
+						}
+						drop(m2);
+					}
+				}
+				drop(m1);
+			}
+		}
+		return nullptr;
+	}
+	// N_0
+	Expr* nt_15(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "N_3"
+		if (first(p0, sets[0])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (push(nt_18(p1))) {
+				skip(p1);
+				// ";"
+				if (first(p1, sets[7])) {
+					StrIter p2 = p1;
+					ExprArena::Mark m2 = mark();
+					if (last - p2 >= 1 && !std::memcmp(p2, ";", 1) && lexeme(p2, 1)) {
+						skip(p2);
+						// "N_0"
+						{
+							StrIter p3 = p2;
+							if (push(nt_15(p3))) {
+								return accept(b, p3, 5, base, pos);
+							}
+						}
+						drop(m2);
+					}
+				}
+				drop(m1);
+			}
+		}
+		// ""
+		{
+			StrIter p1 = p0;
+			if (lexeme(p1, 0)) {
+				return accept(b, p1, 6, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// N_1
+	Expr* nt_16(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "+"
+		if (first(p0, sets[8])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (last - p1 >= 1 && !std::memcmp(p1, "+", 1) && lexeme(p1, 1)) {
+				skip(p1);
+				// "T"
+				if (first(p1, sets[0])) {
+					StrIter p2 = p1;
+					ExprArena::Mark m2 = mark();
+					if (push(nt_3(p2))) {
+						skip(p2);
+						// "N_1"
+						{
+							StrIter p3 = p2;
+							if (push(nt_16(p3))) {
+								return accept(b, p3, 7, base, pos);
+							}
+						}
+						drop(m2);
+					}
+				}
+				drop(m1);
+			}
+		}
+		// ""
+		{
+			StrIter p1 = p0;
+			if (lexeme(p1, 0)) {
+				return accept(b, p1, 8, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// N_2
+	Expr* nt_17(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "*"
+		if (first(p0, sets[9])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (last - p1 >= 1 && !std::memcmp(p1, "*", 1) && lexeme(p1, 1)) {
+				skip(p1);
+				// "F"
+				if (first(p1, sets[0])) {
+					StrIter p2 = p1;
+					ExprArena::Mark m2 = mark();
+					if (push(nt_4(p2))) {
+						skip(p2);
+						// "N_2"
+						{
+							StrIter p3 = p2;
+							if (push(nt_17(p3))) {
+								return accept(b, p3, 9, base, pos);
+							}
+						}
+						drop(m2);
+					}
+				}
+				drop(m1);
+			}
+		}
+		// ""
+		{
+			StrIter p1 = p0;
+			if (lexeme(p1, 0)) {
+				return accept(b, p1, 10, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// N_3
+	Expr* nt_18(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "L"
+		if (first(p0, sets[5])) {
+			StrIter p1 = p0;
+			if (push(nt_5(p1))) {
+				return accept(b, p1, 13, base, pos);
+			}
+		}
+		// "E"
+		if (first(p0, sets[0])) {
+			StrIter p1 = p0;
+			if (push(nt_2(p1))) {
+				return accept(b, p1, 14, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// S
+	Expr* nt_1(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "N_0"
+		{
+			StrIter p1 = p0;
+			if (push(nt_15(p1))) {
+				return accept(b, p1, 0, base, pos);
+			}
+		}
+		return nullptr;
+	}
+	// T
+	Expr* nt_3(StrIter& pos) {
+		StrIter b = pos;
+		skip(b);
+		size_t base = kids.size();
+		StrIter p0 = b;
+		// "F"
+		if (first(p0, sets[0])) {
+			StrIter p1 = p0;
+			ExprArena::Mark m1 = mark();
+			if (push(nt_4(p1))) {
+				skip(p1);
+				// "N_2"
+				{
+					StrIter p2 = p1;
+					if (push(nt_17(p2))) {
+						return accept(b, p2, 3, base, pos);
+					}
+				}
+				drop(m1);
+			}
+		}
+		return nullptr;
+	}
+};
+
+constexpr uint64_t ExprParser::sets[][5];
+
+}
+}